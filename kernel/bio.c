@@ -4,75 +4,367 @@
 #include "fs.h"
 #include "buf.h"
 #include "lock.h"
+#include "param.h"
+#include "memlayout.h"
 
-struct {
+// buffers are found through a hash of (dev, blockno), every
+// bucket with its own lock, so hits on different buckets don't
+// contend. the LRU list has a lock of its own, and misses are
+// serialized by evict_lock so one block never gets two buffers.
+// lock order: evict_lock, lru_lock, bucket lock.
+//
+// modified buffers are marked dirty with bdirty instead of being
+// written at once. the flusher task writes them back, sorted and
+// in multi-block requests, every FLUSH_INTERVAL ticks or when too
+// many are dirty. dirty buffers are never evicted.
+//
+// the cache starts with NBUF buffers and grows a page of buffers
+// at a time, up to 1/BCACHE_FRAC of RAM, instead of evicting.
+// when memory runs out mem_malloc calls bshrink to give pages back.
+// if every buffer is busy or dirty, bget may grow NRESERVE buffers
+// past the limit, then waits for one to be released or cleaned.
+
+#define NBUCKET 31
+#define BPP (PGSIZE / BSIZE) // buffers sharing one page of data
+#define NRESERVE (4 * BPP)   // emergency buffers above maxbuf
+
+struct bucket {
   lm_lock_t lock;
-  struct buf buf[NBUF];
+  struct buf *head; // chain through hnext
+};
+
+struct {
+  struct bucket bucket[NBUCKET];
+
+  lm_lock_t evict_lock;
+  int nbuf;    // protected by evict_lock
+  int maxbuf;
+  int ndirty;
+  int flush_now; // too many dirty buffers, flush before the interval
+  int waiting;   // bget calls waiting for a buffer, protected by evict_lock
 
   // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
+  // Sorted by how recently the buffer was released.
   // head.next is most recent, head.prev is least.
+  lm_lock_t lru_lock;
   struct buf head;
+
+  struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t grows;   // pages added
+    uint64_t shrinks; // pages given back
+    uint64_t ra_blocks; // read ahead
+    uint64_t ra_hits;   // read ahead and then used
+    uint64_t ra_wasted; // read ahead and evicted unused
+    uint64_t flushes;   // flusher rounds
+    uint64_t written;   // dirty blocks written back
+  } stat;
 } bcache;
 
+static struct bucket*
+bhash(uint_t dev, uint_t blockno)
+{
+  return &bcache.bucket[(dev * 7 + blockno) % NBUCKET];
+}
+
+// unlink b from the chain of bk, must hold bk->lock
+static void
+bucket_remove(struct bucket *bk, struct buf *b)
+{
+  struct buf **pp = &bk->head;
+  while(*pp != b)
+    pp = &(*pp)->hnext;
+  *pp = b->hnext;
+  b->hnext = 0;
+}
+
+// put an unused buf without a block in the bucket of block 0
+static void
+bucket_park(struct buf *b)
+{
+  struct bucket *bk = bhash(0, 0);
+  b->dev = 0;
+  b->blockno = 0;
+  b->valid = 0;
+  lm_lock(&bk->lock);
+  b->hnext = bk->head;
+  bk->head = b;
+  lm_unlock(&bk->lock);
+}
+
+// add a page worth of buffers at the LRU end,
+// so they are the next to be used.
+// must not hold any bcache lock, mem_malloc may call bshrink.
+static void brelse_unchecked(struct buf *b);
+static void bflusher(void *arg);
+
+extern lm_lock_t tickslock;
+extern volatile uint_t *ticks;
+
+static int
+bgrow(void)
+{
+  char *page = mem_malloc(PGSIZE);
+  struct buf *g = mem_malloc(BPP * sizeof(struct buf));
+  if(page == 0 || g == 0){
+    if(page)
+      mem_free(page);
+    if(g)
+      mem_free(g);
+    return 0;
+  }
+  memset(g, 0, BPP * sizeof(struct buf));
+  for(int i = 0; i < BPP; i++){
+    struct buf *b = &g[i];
+    lm_sem_init(&b->sem, 1); // semaphore lock
+    b->data = (uchar_t*)page + i * BSIZE;
+    b->group = g;
+    bucket_park(b);
+    lm_lock(&bcache.lru_lock);
+    b->prev = bcache.head.prev;
+    b->next = &bcache.head;
+    bcache.head.prev->next = b;
+    bcache.head.prev = b;
+    lm_unlock(&bcache.lru_lock);
+  }
+  __sync_fetch_and_add(&bcache.stat.grows, 1);
+  return 1;
+}
+
 void
 binit(void)
 {
-  struct buf *b;
+  for(int i = 0; i < NBUCKET; i++)
+    lm_lockinit(&bcache.bucket[i].lock, "bcache.bucket");
+  lm_lockinit(&bcache.evict_lock, "bcache.evict");
+  lm_lockinit(&bcache.lru_lock, "bcache.lru");
 
-  lm_lockinit(&bcache.lock, "bcache");
-
-  // Create linked list of buffers
   bcache.head.prev = &bcache.head;
   bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    lm_sem_init(&b->sem, 1); // semaphore lock
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  bcache.maxbuf = (PHYSTOP - PHYSTATR) / BCACHE_FRAC / BSIZE;
+  while(bcache.nbuf < NBUF){
+    if(!bgrow())
+      panic("binit");
+    bcache.nbuf += BPP;
   }
+
+  if(task_create(bflusher, 0) == 0)
+    panic("binit: flusher");
 }
 
-// Look through buffer cache for block on device dev.
-// If not found, allocate a buffer.
-// In either case, return locked buffer.
+// find the buffer of the block in bk and take a reference.
+// must hold bk->lock
 static struct buf*
-bget(uint_t dev, uint_t blockno)
+bucket_get(struct bucket *bk, uint_t dev, uint_t blockno)
 {
   struct buf *b;
 
-  lm_lock(&bcache.lock);
-
-  // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
+  for(b = bk->head; b; b = b->hnext){
     if(b->dev == dev && b->blockno == blockno){
       b->refcnt++;
-      lm_unlock(&bcache.lock);
-      lm_P(&b->sem);
-      b->holding_task = getpid();
       return b;
     }
   }
+  return 0;
+}
 
-  // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
+// take the least recently used unused buffer for the block.
+// must hold evict_lock
+static struct buf*
+bvictim(uint_t dev, uint_t blockno)
+{
+  struct buf *b;
+
+  lm_lock(&bcache.lru_lock);
   for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
+    struct bucket *vbk = bhash(b->dev, b->blockno);
+    lm_lock(&vbk->lock);
+    if(b->refcnt == 0 && !b->dirty) {
+      bucket_remove(vbk, b);
+      if(b->valid)
+        bcache.stat.evictions++;
+      if(b->prefetched){
+        bcache.stat.ra_wasted++;
+        b->prefetched = 0;
+      }
       b->dev = dev;
       b->blockno = blockno;
       b->valid = 0;
+      b->end_io = 0;
       b->refcnt = 1;
-      lm_unlock(&bcache.lock);
-      lm_P(&b->sem);
-      b->holding_task = getpid();
+      lm_unlock(&vbk->lock);
+      lm_unlock(&bcache.lru_lock);
       return b;
     }
+    lm_unlock(&vbk->lock);
+  }
+  lm_unlock(&bcache.lru_lock);
+  return 0;
+}
+
+// a buffer was released or cleaned, wake bget if it waits for one.
+// bget counts itself in waiting before it looks for a victim and
+// sleeps holding evict_lock, so taking evict_lock here can't miss it.
+static void
+bwake(void)
+{
+  if(bcache.waiting == 0)
+    return;
+  lm_lock(&bcache.evict_lock);
+  wakeup(&bcache.waiting);
+  lm_unlock(&bcache.evict_lock);
+}
+
+// Look through buffer cache for block on device dev.
+// If not found, allocate a buffer.
+// In either case, return locked buffer.
+static struct buf*
+bget(uint_t dev, uint_t blockno)
+{
+  struct buf *b;
+  struct bucket *bk = bhash(dev, blockno);
+
+  // Is the block already cached?
+  lm_lock(&bk->lock);
+  b = bucket_get(bk, dev, blockno);
+  lm_unlock(&bk->lock);
+  if(b){
+    __sync_fetch_and_add(&bcache.stat.hits, 1);
+    goto found;
+  }
+
+  // Not cached.
+  __sync_fetch_and_add(&bcache.stat.misses, 1);
+  lm_lock(&bcache.evict_lock);
+  int force = 0; // every buffer is in use
+  for(;;){
+    // someone else may have brought it in meanwhile.
+    lm_lock(&bk->lock);
+    b = bucket_get(bk, dev, blockno);
+    lm_unlock(&bk->lock);
+    if(b)
+      break;
+
+    // grow rather than evict while there is room
+    if(bcache.nbuf < bcache.maxbuf ||
+       (force && bcache.nbuf < bcache.maxbuf + NRESERVE)){
+      bcache.nbuf += BPP;
+      lm_unlock(&bcache.evict_lock);
+      int grown = bgrow();
+      lm_lock(&bcache.evict_lock);
+      if(grown)
+        continue;
+      bcache.nbuf -= BPP;
+    }
+    if(force){
+      // the flusher sees it on the next tick
+      bcache.flush_now = 1;
+      bcache.waiting++;
+    }
+
+    // Recycle the least recently used (LRU) unused buffer.
+    if((b = bvictim(dev, blockno)) != 0){
+      if(force)
+        bcache.waiting--;
+      lm_lock(&bk->lock);
+      b->hnext = bk->head;
+      bk->head = b;
+      lm_unlock(&bk->lock);
+      break;
+    }
+    if(force){
+      // wait for a buffer to be released or written back
+      sleep(&bcache.waiting, &bcache.evict_lock);
+      bcache.waiting--;
+    }
+    force = 1;
+  }
+  lm_unlock(&bcache.evict_lock);
+
+found:
+  lm_P(&b->sem);
+  b->holding_task = getpid();
+  if(b->prefetched){
+    b->prefetched = 0;
+    __sync_fetch_and_add(&bcache.stat.ra_hits, 1);
+  }
+  return b;
+}
+
+// try to take every buffer of the page of g out of the cache.
+// must hold evict_lock and lru_lock
+static int
+bgroup_take(struct buf *g)
+{
+  int i;
+  for(i = 0; i < BPP; i++){
+    struct buf *b = &g[i];
+    struct bucket *bk = bhash(b->dev, b->blockno);
+    lm_lock(&bk->lock);
+    if(b->refcnt != 0 || b->dirty){
+      lm_unlock(&bk->lock);
+      break;
+    }
+    bucket_remove(bk, b);
+    lm_unlock(&bk->lock);
   }
-  panic("bget: no buffers");
+  if(i == BPP)
+    return 1;
+  // someone uses one of them, put the others back empty
+  while(--i >= 0)
+    bucket_park(&g[i]);
   return 0;
 }
 
+// give up to npages pages of unused buffers back to the
+// memory allocator, keeping at least NBUF buffers.
+// return the number of pages freed.
+int
+bshrink(int npages)
+{
+  int freed = 0;
+  struct buf *b;
+
+  lm_lock(&bcache.evict_lock);
+  lm_lock(&bcache.lru_lock);
+again:
+  for(b = bcache.head.prev; b != &bcache.head && freed < npages; b = b->prev){
+    if(bcache.nbuf - BPP < NBUF)
+      break;
+    if(b->refcnt != 0 || b->dirty || !bgroup_take(b->group))
+      continue;
+    struct buf *g = b->group;
+    for(int i = 0; i < BPP; i++){
+      g[i].next->prev = g[i].prev;
+      g[i].prev->next = g[i].next;
+    }
+    mem_free(g[0].data);
+    mem_free(g);
+    bcache.nbuf -= BPP;
+    bcache.stat.shrinks++;
+    freed++;
+    goto again; // b is gone
+  }
+  lm_unlock(&bcache.lru_lock);
+  lm_unlock(&bcache.evict_lock);
+  return freed;
+}
+
+// cache statistics, for ^T
+void
+bcache_dump(void)
+{
+  printf("bcache: %d buffers (max %d), %d hits %d misses %d evictions, %d pages grown %d shrunk\n",
+         bcache.nbuf, bcache.maxbuf, (int)bcache.stat.hits, (int)bcache.stat.misses,
+         (int)bcache.stat.evictions, (int)bcache.stat.grows, (int)bcache.stat.shrinks);
+  printf("bcache: readahead %d blocks, %d used %d wasted\n",
+         (int)bcache.stat.ra_blocks, (int)bcache.stat.ra_hits, (int)bcache.stat.ra_wasted);
+  printf("bcache: %d dirty, %d flushes wrote %d blocks\n",
+         bcache.ndirty, (int)bcache.stat.flushes, (int)bcache.stat.written);
+}
+
 // Return a locked buf with the contents of the indicated block.
 struct buf*
 bread(uint_t dev, uint_t blockno)
@@ -87,6 +379,89 @@ bread(uint_t dev, uint_t blockno)
   return b;
 }
 
+// Return n locked bufs of blocks blockno..blockno+n-1,
+// not read from disk yet, see bread_fill.
+// taken in ascending order, like everyone holding several.
+void
+bget_run(uint_t dev, uint_t blockno, int n, struct buf **bs)
+{
+  for(int i = 0; i < n; i++)
+    bs[i] = bget(dev, blockno + i);
+}
+
+// Read the bufs of bs that aren't valid yet, each
+// contiguous run of them with a single disk request.
+// all requests are queued before waiting for any.
+// bs must hold consecutive blocks, as from bget_run.
+void
+bread_fill(struct buf **bs, int n)
+{
+  int i = 0, submitted = 0;
+  while(i < n){
+    if(bs[i]->valid){
+      i++;
+      continue;
+    }
+    int j = i + 1;
+    while(j < n && !bs[j]->valid)
+      j++;
+    virtio_disk_submit(bs + i, j - i, 0);
+    submitted = 1;
+    i = j;
+  }
+  if(!submitted)
+    return;
+  for(i = 0; i < n; i++){
+    if(!bs[i]->valid){
+      virtio_disk_wait(bs[i]);
+      bs[i]->valid = 1;
+    }
+  }
+}
+
+// the bufs are on disk now. must hold them
+static void
+bclean(struct buf **bs, int n)
+{
+  for(int i = 0; i < n; i++){
+    if(bs[i]->dirty){
+      bs[i]->dirty = 0;
+      __sync_fetch_and_sub(&bcache.ndirty, 1);
+    }
+  }
+  bwake();
+}
+
+// Start writing n locked bufs of consecutive blocks with one
+// request, without waiting for it. several runs may be started
+// and then waited for together with bwrite_wait.
+void
+bwrite_start(struct buf **bs, int n)
+{
+  for(int i = 0; i < n; i++){
+    if(bs[i]->holding_task != getpid())
+      panic("bwrite_start");
+  }
+  virtio_disk_submit(bs, n, 1);
+}
+
+// Wait for the started writes of n locked bufs, any blocks.
+void
+bwrite_wait(struct buf **bs, int n)
+{
+  for(int i = 0; i < n; i++)
+    virtio_disk_wait(bs[i]);
+  bclean(bs, n);
+}
+
+// Write n locked bufs of consecutive blocks with one request.
+void
+bwrite_run(struct buf **bs, int n)
+{
+  bwrite_start(bs, n);
+  bwrite_wait(bs, n);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -94,6 +469,192 @@ bwrite(struct buf *b)
   if(b->holding_task != getpid())
     panic("bwrite");
   virtio_disk_rw(b, 1);
+  bclean(&b, 1);
+}
+
+// b was modified, write it back later.  Must be locked.
+void
+bdirty(struct buf *b)
+{
+  if(b->holding_task != getpid())
+    panic("bdirty");
+  b->valid = 1;
+  if(b->dirty)
+    return;
+  b->dirty = 1;
+  if(__sync_add_and_fetch(&bcache.ndirty, 1) > bcache.nbuf / 2)
+    bcache.flush_now = 1;
+}
+
+#define FLUSH_BATCH 64
+
+// the locked buffer of the block if it is cached and nobody
+// holds it, else 0. never sleeps.
+static struct buf*
+bget_try(uint_t dev, uint_t blockno)
+{
+  struct bucket *bk = bhash(dev, blockno);
+  struct buf *b;
+
+  lm_lock(&bk->lock);
+  for(b = bk->head; b; b = b->hnext){
+    if(b->dev == dev && b->blockno == blockno){
+      if(lm_P_try(&b->sem))
+        b->refcnt++;
+      else
+        b = 0;
+      break;
+    }
+  }
+  lm_unlock(&bk->lock);
+  if(b)
+    b->holding_task = getpid();
+  return b;
+}
+
+struct bkey {
+  uint_t dev;
+  uint_t blockno;
+};
+
+// start the open run held[*run..*nheld), wait for every write
+// started, release the bufs.
+static void
+bflush_finish(struct buf **held, int *run, int *nheld)
+{
+  if(*nheld > *run)
+    bwrite_start(held + *run, *nheld - *run);
+  bwrite_wait(held, *nheld);
+  __sync_fetch_and_add(&bcache.stat.written, *nheld);
+  for(int j = 0; j < *nheld; j++)
+    brelse(held[j]);
+  *run = *nheld = 0;
+}
+
+// write back up to FLUSH_BATCH dirty buffers, oldest first,
+// in block order and merged into runs. every run is started
+// before any is waited for, so the disk gets them all at once.
+// it never waits for a buffer while holding others: bmap holds an
+// indirect block while it waits for a bitmap block in balloc, and
+// the flusher may hold that bitmap block. on a busy buffer the
+// writes started so far are finished first, and the buffer is
+// waited for with nothing held.
+// return the number of dirty buffers found.
+static int
+bflush_batch(void)
+{
+  struct bkey keys[FLUSH_BATCH];
+  struct buf *b, *held[FLUSH_BATCH];
+  int n = 0, nheld = 0, run = 0; // held[run..nheld) is not started yet
+
+  lm_lock(&bcache.lru_lock);
+  for(b = bcache.head.prev; b != &bcache.head && n < FLUSH_BATCH; b = b->prev){
+    if(b->dirty)
+      keys[n++] = (struct bkey){b->dev, b->blockno};
+  }
+  lm_unlock(&bcache.lru_lock);
+
+  // insertion sort, the batch is small
+  for(int i = 1; i < n; i++){
+    struct bkey key = keys[i];
+    int j = i - 1;
+    while(j >= 0 && (keys[j].dev > key.dev ||
+                     (keys[j].dev == key.dev && keys[j].blockno > key.blockno))){
+      keys[j + 1] = keys[j];
+      j--;
+    }
+    keys[j + 1] = key;
+  }
+
+  for(int i = 0; i < n; i++){
+    b = 0;
+    if(nheld > 0 && (b = bget_try(keys[i].dev, keys[i].blockno)) == 0)
+      bflush_finish(held, &run, &nheld);
+    if(b == 0)
+      b = bget(keys[i].dev, keys[i].blockno); // holding nothing
+    if(!b->dirty){
+      // written back by someone else meanwhile
+      brelse(b);
+      continue;
+    }
+    if(nheld > run && (nheld - run == MAXBRUN || b->dev != held[nheld-1]->dev ||
+                       b->blockno != held[nheld-1]->blockno + 1)){
+      bwrite_start(held + run, nheld - run);
+      run = nheld;
+    }
+    held[nheld++] = b;
+  }
+  if(nheld > 0)
+    bflush_finish(held, &run, &nheld);
+  return n;
+}
+
+// write back every dirty buffer.
+void
+bflush(void)
+{
+  while(bflush_batch() > 0)
+    ;
+}
+
+// the flusher task
+static void
+bflusher(void *arg)
+{
+  uint_t last = *ticks;
+
+  for(;;){
+    lm_lock(&tickslock);
+    while(*ticks - last < FLUSH_INTERVAL && !bcache.flush_now)
+      sleep(&ticks, &tickslock);
+    lm_unlock(&tickslock);
+
+    last = *ticks;
+    bcache.flush_now = 0;
+    bcache.stat.flushes++;
+    bflush();
+  }
+}
+
+// completion of a readahead request, in the disk interrupt.
+// nobody waits for the buf, so release it here.
+static void
+bra_done(struct buf *b)
+{
+  b->end_io = 0;
+  b->valid = 1;
+  b->prefetched = 1;
+  brelse_unchecked(b);
+}
+
+// start reading blocks blockno..blockno+n-1 into the cache
+// without waiting. blocks already cached are skipped.
+void
+breadahead(uint_t dev, uint_t blockno, int n)
+{
+  struct buf *bs[MAXBRUN];
+  int k = 0;
+
+  // submit each contiguous run of missing blocks
+  for(int i = 0; i <= n; i++){
+    struct buf *b = 0;
+    if(i < n){
+      b = bget(dev, blockno + i);
+      if(b->valid){
+        brelse(b);
+        b = 0;
+      }
+    }
+    if(k > 0 && (b == 0 || k == MAXBRUN)){
+      __sync_fetch_and_add(&bcache.stat.ra_blocks, k);
+      virtio_disk_submit(bs, k, 0);
+      k = 0;
+    }
+    if(b){
+      b->end_io = bra_done;
+      bs[k++] = b;
+    }
+  }
 }
 
 // Release a locked buffer.
@@ -103,10 +664,21 @@ brelse(struct buf *b)
 {
   if(b->holding_task != getpid())
     panic("brelse");
+  brelse_unchecked(b);
+}
 
+// brelse without checking that the caller holds b,
+// for releasing from the disk interrupt.
+static void
+brelse_unchecked(struct buf *b)
+{
   lm_V(&b->sem);
 
-  lm_lock(&bcache.lock);
+  // hold lru_lock across the drop of refcnt, so bshrink can't
+  // free b's page between the drop and the move in the list.
+  struct bucket *bk = bhash(b->dev, b->blockno);
+  lm_lock(&bcache.lru_lock);
+  lm_lock(&bk->lock);
   b->refcnt--;
   if (b->refcnt == 0) {
     // no one is waiting for it.
@@ -117,22 +689,33 @@ brelse(struct buf *b)
     bcache.head.next->prev = b;
     bcache.head.next = b;
   }
-  
-  lm_unlock(&bcache.lock);
+  int unused = b->refcnt == 0;
+  lm_unlock(&bk->lock);
+  lm_unlock(&bcache.lru_lock);
+  if(unused)
+    bwake();
 }
 
+// keep b in the cache until bunpin. the log writes it back from
+// now on, so it leaves the flusher's dirty set.
 void
 bpin(struct buf *b) {
-  lm_lock(&bcache.lock);
+  struct bucket *bk = bhash(b->dev, b->blockno);
+  lm_lock(&bk->lock);
   b->refcnt++;
-  lm_unlock(&bcache.lock);
+  lm_unlock(&bk->lock);
+  if(b->dirty){
+    b->dirty = 0;
+    __sync_fetch_and_sub(&bcache.ndirty, 1);
+  }
 }
 
 void
 bunpin(struct buf *b) {
-  lm_lock(&bcache.lock);
+  struct bucket *bk = bhash(b->dev, b->blockno);
+  lm_lock(&bk->lock);
   b->refcnt--;
-  lm_unlock(&bcache.lock);
+  lm_unlock(&bk->lock);
 }
 
 
@@ -11,7 +11,13 @@ struct buf {
   uint_t refcnt;
   struct buf *prev; // LRU cache list
   struct buf *next;
-  uchar_t data[BSIZE];
+  struct buf *hnext; // hash bucket chain
+  uchar_t *data;  // BSIZE bytes, in a page shared with the rest of group
+  struct buf *group; // the BPP bufs allocated together
   uint_t holding_task; // the task holding this buffer
+  struct buf *io_next; // next buf of the same disk request
+  void (*end_io)(struct buf *b); // called by the disk interrupt when done, if set
+  int prefetched; // read ahead and not used yet
+  int dirty;      // modified, not written back yet, see bdirty
 };
 
@@ -7,6 +7,7 @@
 //   control-u -- kill line
 //   control-d -- end of file
 //   control-p -- print process list
+//   control-t -- print kernel statistics
 //
 
 #include <stdarg.h>
@@ -54,19 +55,39 @@ struct {
   uint32_t e;  // Edit index
 } cons;
 
+// counters of every subsystem, for ^T
+static void
+statdump(void)
+{
+  printf("\n");
+  waitq_dump();
+  mem_dump();
+  bcache_dump();
+  log_dump();
+  icache_dump();
+  dcache_dump();
+  disk_dump();
+  uart_dump();
+}
+
 //
 // user write()s to the console go here.
 //
+// copied in chunks and queued for the uart, the writer
+// only waits when the uart's buffer is full.
 uint64_t
 console_write(device_t*dev, int user_src, uint64_t src, uint64_t n)
 {
-  int i;
+  char buf[128];
+  uint64_t i, m;
 
-  for(i = 0; i < n; i++){
-    char c;
-    if(either_copyin(&c, user_src, src+i, 1) == -1)
+  for(i = 0; i < n; i += m){
+    m = n - i < sizeof(buf) ? n - i : sizeof(buf);
+    if(either_copyin(buf, user_src, src+i, m) == -1)
       break;
-    uart_putc(c);
+    int w = uart_write(buf, m);
+    if(w < m)
+      return i + w;
   }
 
   return i;
@@ -143,6 +164,9 @@ console_intr(int c)
   case C('P'):  // Print process list.
     procdump();
     break;
+  case C('T'):  // Print kernel statistics.
+    statdump();
+    break;
   case C('U'):  // Kill line.
     while(cons.e != cons.w &&
           cons.buf[(cons.e-1) % INPUT_BUF_SIZE] != '\n'){
@@ -0,0 +1,182 @@
+// directory name cache
+// maps (dev, directory inum, name) to the inum the name links to,
+// so path lookups skip the directory scan. a name known to be
+// missing is cached too, with inum 0, since shells and exec look
+// up the same missing names again and again.
+// dirlookup fills the cache and dirlink updates it, both under
+// the directory's lock, so an entry never disagrees with the
+// directory.
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "fs.h"
+#include "lock.h"
+
+#define NDCBUCKET 61
+
+struct dentry {
+  uint_t dev;
+  uint_t dinum; // the directory
+  char name[DIRSIZ];
+  uint_t inum;  // 0 if name is not in the directory
+  struct dentry *hnext; // hash chain
+  struct dentry *prev;  // LRU list
+  struct dentry *next;
+};
+
+struct {
+  lm_lock_t lock;
+  struct dentry entry[NDCACHE];
+  struct dentry *bucket[NDCBUCKET];
+
+  // head.next is most recent, head.prev is least.
+  struct dentry head;
+
+  struct {
+    uint64_t hits;
+    uint64_t neg_hits; // hits on a missing name
+    uint64_t misses;
+  } stat;
+} dcache;
+
+static uint_t
+dchash(uint_t dev, uint_t dinum, char *name)
+{
+  uint_t h = dev * 31 + dinum * 1009;
+  for(int i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 33 + name[i];
+  return h % NDCBUCKET;
+}
+
+static void
+lru_unlink(struct dentry *d)
+{
+  d->next->prev = d->prev;
+  d->prev->next = d->next;
+}
+
+static void
+lru_push(struct dentry *d)
+{
+  d->next = dcache.head.next;
+  d->prev = &dcache.head;
+  dcache.head.next->prev = d;
+  dcache.head.next = d;
+}
+
+static void
+lru_append(struct dentry *d)
+{
+  d->prev = dcache.head.prev;
+  d->next = &dcache.head;
+  dcache.head.prev->next = d;
+  dcache.head.prev = d;
+}
+
+// unused entries have dinum 0 and wait at the LRU tail
+static void
+hash_unlink(struct dentry *d)
+{
+  struct dentry **pp = &dcache.bucket[dchash(d->dev, d->dinum, d->name)];
+  while(*pp != d)
+    pp = &(*pp)->hnext;
+  *pp = d->hnext;
+  d->dinum = 0;
+}
+
+static struct dentry*
+dcache_find(uint_t dev, uint_t dinum, char *name)
+{
+  struct dentry *d;
+
+  for(d = dcache.bucket[dchash(dev, dinum, name)]; d; d = d->hnext){
+    if(d->dev == dev && d->dinum == dinum && namecmp(d->name, name) == 0)
+      return d;
+  }
+  return 0;
+}
+
+void
+dcache_init(void)
+{
+  lm_lockinit(&dcache.lock, "dcache");
+  dcache.head.prev = &dcache.head;
+  dcache.head.next = &dcache.head;
+  for(struct dentry *d = dcache.entry; d < &dcache.entry[NDCACHE]; d++)
+    lru_append(d);
+}
+
+// look name up in directory dinum. return 1 and set *inum,
+// 0 for a missing name, if the answer is cached, else 0.
+// caller must hold the directory's lock.
+int
+dcache_lookup(uint_t dev, uint_t dinum, char *name, uint_t *inum)
+{
+  struct dentry *d;
+
+  lm_lock(&dcache.lock);
+  if((d = dcache_find(dev, dinum, name)) == 0){
+    dcache.stat.misses++;
+    lm_unlock(&dcache.lock);
+    return 0;
+  }
+  lru_unlink(d);
+  lru_push(d);
+  *inum = d->inum;
+  if(d->inum)
+    dcache.stat.hits++;
+  else
+    dcache.stat.neg_hits++;
+  lm_unlock(&dcache.lock);
+  return 1;
+}
+
+// remember that name in directory dinum links to inum,
+// or is missing if inum is 0.
+// caller must hold the directory's lock.
+void
+dcache_enter(uint_t dev, uint_t dinum, char *name, uint_t inum)
+{
+  struct dentry *d;
+
+  lm_lock(&dcache.lock);
+  if((d = dcache_find(dev, dinum, name)) == 0){
+    // recycle the least recently used entry
+    d = dcache.head.prev;
+    if(d->dinum)
+      hash_unlink(d);
+    d->dev = dev;
+    d->dinum = dinum;
+    strncpy(d->name, name, DIRSIZ);
+    uint_t h = dchash(dev, dinum, d->name);
+    d->hnext = dcache.bucket[h];
+    dcache.bucket[h] = d;
+  }
+  d->inum = inum;
+  lru_unlink(d);
+  lru_push(d);
+  lm_unlock(&dcache.lock);
+}
+
+// forget every entry of directory inum and every name linking
+// to inum, when the inode is freed and its number may be reused.
+void
+dcache_forget(uint_t dev, uint_t inum)
+{
+  lm_lock(&dcache.lock);
+  for(struct dentry *d = dcache.entry; d < &dcache.entry[NDCACHE]; d++){
+    if(d->dinum && d->dev == dev && (d->dinum == inum || d->inum == inum)){
+      hash_unlink(d);
+      lru_unlink(d);
+      lru_append(d);
+    }
+  }
+  lm_unlock(&dcache.lock);
+}
+
+void
+dcache_dump(void)
+{
+  printf("dcache: %d hits, %d negative hits, %d misses\n",
+         (int)dcache.stat.hits, (int)dcache.stat.neg_hits, (int)dcache.stat.misses);
+}
@@ -6,6 +6,8 @@
 // ------------------- uart.c ------------------- 
 void uart_init(void);
 void uart_putc(char c);
+int uart_write(const char *s, int n);
+void uart_dump(void);
 int uart_getc(void);
 void uart_intr(void);
 
@@ -21,12 +23,14 @@ void scheduler(void);
 void task_init();
 task_t* task_create(void (*entry)(void*), void *arg);
 void yield();
+void make_runnable(task_t *t);
 void exit(int status);
 void force_exit(task_t *t);
 void handle_timer_interrupt();
 task_t *mytask(void);
 void sleep(void *chan, lm_lock_t *lk);
 void wakeup(void *chan);
+void waitq_dump();
 void user_init();
 void ret_entry();
 int alloc_pid();
@@ -76,6 +80,7 @@ void *memset(void *s, int c, size_t n);
 void *memmove(void *dst, const void *src, size_t n);
 void *memcpy(void *out, const void *in, size_t n);
 int memcmp(const void *s1, const void *s2, size_t n);
+extern int has_rvv;
 
 
 // ------------------- mem.c -------------------
@@ -83,6 +88,10 @@ int memcmp(const void *s1, const void *s2, size_t n);
 void mem_init();
 void* mem_malloc(size_t size);
 void mem_free(void* ptr);
+void mem_dump();
+void ref_cnt_inc(uint64_t pa);
+void ref_cnt_dec(uint64_t pa);
+int ref_cnt_get(uint64_t pa);
 
 // ------------------- lock.c -------------------
 typedef struct lm_sleeplock lm_sleeplock_t;
@@ -100,6 +109,7 @@ void lm_sleepunlock(lm_sleeplock_t *lk);
 int lm_holdingsleep(lm_sleeplock_t *lk);
 void lm_V(semophore_t *sem);
 void lm_P(semophore_t *sem);
+int lm_P_try(semophore_t *sem);
 void lm_sem_init(semophore_t *sem, int value);
 int check_lock(lm_lock_t *lk);
 
@@ -134,10 +144,12 @@ void kvm_inithart();
 pagetable_t vm_create();
 int vm_map(pagetable_t pagetable, uint64_t va, uint64_t pa, uint64_t sz, int perm, int remap);
 pte_t* walk(pagetable_t pagetable, uint64_t va, int alloc);
+pagetable_t walk_leaf(pagetable_t pagetable, uint64_t va, int alloc);
 int copyout(pagetable_t pagetable, uint64_t dstva, char *src, uint64_t len);
 int copyin(pagetable_t pagetable, char *dst, uint64_t srcva, uint64_t len);
 void vmunmap(pagetable_t pagetable, uint64_t va, uint64_t npages, int do_free);
 uint64_t walkaddr(pagetable_t pagetable, uint64_t va);
+void uvm_prefault(pagetable_t pagetable, uint64_t va, uint64_t len, int write);
 void vm_unmap(pagetable_t pagetable, uint64_t va, uint64_t npages, int do_free);
 int uvm_map(pagetable_t pagetable, uint64_t va, uint64_t pa, uint64_t sz, int perm, int remap);
 void free_pagetable(pagetable_t pagetable, int do_free);
@@ -154,18 +166,37 @@ void syscall(void);
 
 typedef struct MmapNode MmapNode_t;
 typedef struct Mmap Mmap_t;
+typedef struct inode inode_t;
 uint64_t mmap(task_t *t, uint64_t addr, uint64_t sz, uint64_t perm, uint64_t flag, int alloc_phy);
 int sys_mmap();
-void mmap_destroy(Mmap_t *obj);
+void mmap_destroy(Mmap_t *obj, pagetable_t pagetable);
 void handle_pagefault();
+int mmap_fault(task_t *t, uint64_t va, uint64_t access_perm);
+uint64_t mmap_file(Mmap_t *obj, pagetable_t pagetable, uint64_t addr, uint64_t sz, uint64_t perm, uint64_t flag,
+        inode_t *ip, uint64_t off, uint64_t filesz);
 int uvm_mappages(pagetable_t pagetable, uint64_t va, uint64_t sz, int perm);
 void handle_accessfault();
 void copy_mmap(task_t *t, task_t *nt);
 void mmap_init();
+int munmap(uint64_t addr);
 int sys_munmap();
 uint64_t mmap_by_obj(Mmap_t *obj, pagetable_t pagetable, uint64_t addr, uint64_t sz, uint64_t perm, uint64_t flag, int alloc_phy);
 Mmap_t *mmap_create(task_t *t);
 
+// ------------------- pcache.c -------------------
+
+void pcache_init(void);
+uint64_t pcache_get(inode_t *ip, uint_t pgno);
+void pcache_invalidate(inode_t *ip);
+void pcache_write(inode_t *ip, uint_t off, void *src, uint_t n);
+
+// ------------------- dcache.c -------------------
+void dcache_init(void);
+int dcache_lookup(uint_t dev, uint_t dinum, char *name, uint_t *inum);
+void dcache_enter(uint_t dev, uint_t dinum, char *name, uint_t inum);
+void dcache_forget(uint_t dev, uint_t inum);
+void dcache_dump(void);
+
 // ------------------- file.c -------------------
 struct file;
 
@@ -182,8 +213,18 @@ void console_intr(int c);
 // ------------------- bio.c -------------------
 struct buf;
 void binit(void);
+int bshrink(int npages);
+void bcache_dump(void);
 struct buf* bread(uint_t dev, uint_t blockno);
 void bwrite(struct buf *b);
+void bget_run(uint_t dev, uint_t blockno, int n, struct buf **bs);
+void bread_fill(struct buf **bs, int n);
+void bwrite_run(struct buf **bs, int n);
+void bwrite_start(struct buf **bs, int n);
+void bwrite_wait(struct buf **bs, int n);
+void bdirty(struct buf *b);
+void bflush(void);
+void breadahead(uint_t dev, uint_t blockno, int n);
 void brelse(struct buf *b);
 void bpin(struct buf *b);
 void bunpin(struct buf *b);
@@ -192,17 +233,24 @@ void bunpin(struct buf *b);
 
 void virtio_disk_init(void);
 void virtio_disk_rw(struct buf *b, int write);
+void virtio_disk_rwv(struct buf **bs, int n, int write);
+void virtio_disk_submit(struct buf **bs, int n, int write);
+void virtio_disk_wait(struct buf *b);
+void disk_stat(uint64_t *requests, uint64_t *blocks);
+void disk_dump(void);
 void virtio_disk_intr();
 
 
 // ------------------- fs.c -------------------
 typedef struct inode inode_t;
 void fs_init(int dev);
-uint_t balloc();
+uint_t balloc(int meta);
 inode_t *ialloc(uint_t dev,uint_t type);
 int iupdate(inode_t *ip);
 void bfree(uint_t dev, uint_t b);
+void fmap_commit(void);
 int itrunc(inode_t *ip);
+void icache_dump(void);
 int ilock(inode_t *ip);
 int iunlock(inode_t *ip);
 int iput(inode_t *ip);
@@ -210,14 +258,23 @@ int iunlockput(inode_t *ip);
 uint_t bmap(inode_t *ip, uint_t start);
 int writei(inode_t *ip, int user_src, uint64_t src, uint_t off, uint_t n);
 int readi(inode_t *ip, int user_dst, uint64_t dst, uint_t off, uint_t n);
+struct readahead;
+void ireadahead(inode_t *ip, struct readahead *ra, uint_t off, uint_t n);
 inode_t *idup(inode_t *ip);
 int namecmp(const char *s, const char *t);
 struct inode* dirlookup(struct inode *dp, char *name, uint_t *poff);
 struct inode* namei(char *path);
 struct inode* nameiparent(char *path, char *name);
 int dirlink(inode_t *dip, char *name, int inum);
-void begin_op();
-void end_op();
+void dirunlink(inode_t *dp, char *name, uint_t off);
+
+// ------------------- log.c -------------------
+struct superblock;
+void initlog(int dev, struct superblock *sb);
+void begin_op(void);
+void end_op(void);
+void log_write(struct buf *b);
+void log_dump(void);
 
 // ------------------- exec.c -------------------
 
@@ -234,6 +291,9 @@ int sys_open();
 int sys_chdir();
 int sys_close();
 int sys_ioctl();
+int sys_fsync();
+int sys_diskstat();
+int sys_unlink();
 
 
 // ------------------- virtio_gpu.c -------------------
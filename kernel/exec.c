@@ -7,8 +7,6 @@
 #include "proc.h"
 #include "memlayout.h"
 
-static int loadseg(pagetable_t, uint64_t , struct inode *, uint_t , uint_t );
-
 int flags2perm(int flags)
 {
     int perm = PTE_R;
@@ -31,7 +29,10 @@ exec(char *path, char **argv)
   Mmap_t *mmap_obj=0;
   struct task *t = mytask();
 
+  begin_op();
+
   if((ip = namei(path)) == 0){
+    end_op();
     return -1;
   }
   ilock(ip);
@@ -59,16 +60,17 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr + ph.memsz < ph.vaddr)
       goto bad;
-    if(ph.vaddr % PGSIZE != 0)
+    if(ph.vaddr % PGSIZE != 0 || ph.off % PGSIZE != 0)
       goto bad;
-    uint64_t maddr = mmap_by_obj(mmap_obj, pagetable, ph.vaddr, ph.memsz, flags2perm(ph.flags), MAP_PRIVATE, 1);
+    // map the segment from the file, pages are read in
+    // on first touch and read-only ones come from the page cache
+    uint64_t maddr = mmap_file(mmap_obj, pagetable, ph.vaddr, ph.memsz, flags2perm(ph.flags), MAP_PRIVATE | MAP_ZERO,
+                               ip, ph.off, ph.filesz);
     if(maddr != ph.vaddr)
       goto bad;
-
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
-      goto bad;
   }
   iunlockput(ip);
+  end_op();
   ip = 0;
 
   t = mytask();
@@ -112,55 +114,28 @@ exec(char *path, char **argv)
 
 
   // Commit to the user image.
+  if(t->mmap_obj)
+    mmap_destroy(t->mmap_obj, t->pagetable);
   if(t->pagetable)
     free_pagetable(t->pagetable, 0);
-  if(t->mmap_obj)
-    mmap_destroy(t->mmap_obj);
   t->pagetable = pagetable;
   t->mmap_obj = mmap_obj;
   memset(t->trapframe, 0, sizeof(t->trapframe));
   t->trapframe->epc = elf.entry;  // initial program counter = main
   t->trapframe->sp = sp; // initial stack pointer
 
-  end_op();
-
   return 0; 
 
  bad:
   panic("exec bad");
 
-  if(pagetable)
-    free_pagetable(pagetable, 0);
-  if(mmap_obj)
-    mmap_destroy(mmap_obj);
   if(ip){
     iunlockput(ip);
+    end_op();
   }
-  end_op();
+  if(mmap_obj)
+    mmap_destroy(mmap_obj, pagetable);
+  if(pagetable)
+    free_pagetable(pagetable, 0);
   return -1;
 }
-
-// Load a program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
-// Returns 0 on success, -1 on failure.
-static int
-loadseg(pagetable_t pagetable, uint64_t va, struct inode *ip, uint_t offset, uint_t sz)
-{
-  uint_t i, n;
-  uint64_t pa;
-
-  for(i = 0; i < sz; i += PGSIZE){
-    pa = walkaddr(pagetable, va + i);
-    if(pa == 0)
-      panic("loadseg: address should exist");
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, 0, (uint64_t)pa, offset+i, n) != n)
-      return -1;
-  }
-  
-  return 0;
-}
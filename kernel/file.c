@@ -20,6 +20,7 @@ file_t *filealloc(void){
         if (ftable.files[i].ref == 0)
         {
             ftable.files[i].ref = 1;
+            ftable.files[i].type = FD_NONE;
             lm_unlock(&ftable.lock);
             return &ftable.files[i];
         }
@@ -31,8 +32,21 @@ file_t *filealloc(void){
 
 void fileclose(file_t* f){
     lm_lock(&ftable.lock);
-    f->ref--;
+    if(--f->ref > 0){
+        lm_unlock(&ftable.lock);
+        return;
+    }
+    file_t ff = *f;
+    f->type = FD_NONE;
     lm_unlock(&ftable.lock);
+
+    // the last reference of the inode gives back the blocks
+    // it reserved to grow into, see iput
+    if(ff.type == FD_INODE || ff.type == FD_DEVICE){
+        begin_op();
+        iput(ff.ip);
+        end_op();
+    }
 }
 
 file_t* filedup(file_t *f){
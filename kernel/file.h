@@ -17,6 +17,13 @@ struct device {
 };
 typedef struct device device_t;
 
+// sequential readahead state of an open file
+struct readahead {
+  uint_t next;  // block a sequential read would start at
+  uint_t win;   // blocks to keep read ahead, 0 while access looks random
+  uint_t ahead; // blocks before this one have been prefetched
+};
+
 typedef struct file {
   enum { FD_NONE, FD_DEVICE, FD_INODE } type;
   int ref; // reference count
@@ -27,6 +34,7 @@ typedef struct file {
 //   struct pipe *pipe; // FD_PIPE
   struct inode *ip;  // FD_INODE and FD_DEVICE
   uint_t off;          // FD_INODE
+  struct readahead ra; // FD_INODE
   
 }file_t;
 
@@ -35,8 +43,12 @@ typedef struct file {
 typedef struct inode {
   uint_t dev;           // Device number
   uint_t inum;          // Inode number
-  int ref;            // Reference count (protected by itable lock)
-  int valid;          // inode has been read from disk? (protected by itable lock)
+  int ref;            // Reference count (protected by its bucket lock)
+  int valid;          // inode has been read from disk? (protected by lock)
+  struct inode *hnext; // hash chain
+  struct inode *prev;  // LRU list of unreferenced inodes
+  struct inode *next;
+  int onlru;
   
   // copy of disk inode
   semophore_t lock;   // protects everything below here
@@ -45,5 +57,16 @@ typedef struct inode {
   short minor;
   short nlink;
   uint_t size;
-  uint_t addrs[NDIRECT+1];
+  uint_t addrs[NDIRECT+2];
+  // last run of consecutive blocks looked up, see bmap_run
+  struct extent {
+    uint_t lbn;  // first block in the file
+    uint_t pbn;  // its disk block
+    uint_t len;  // blocks, 0 if none
+  } ext;
+  // free blocks reserved for the file to grow into, see balloc_ip
+  struct {
+    uint_t start;
+    uint_t len;
+  } resv;
 }inode_t;
\ No newline at end of file
@@ -7,14 +7,70 @@
 #include "proc.h"
 #include "buf.h"
 
-static semophore_t fs_lock;
-
 struct superblock sb;
 
 uint_t datastart;
+
+// free blocks of every bitmap block, so balloc goes straight to a
+// block with room instead of reading the bitmap from datastart.
+// a count is taken before the bit is set and given back after
+// it is cleared, so it never exceeds the free bits of its block.
+// the cursor makes allocation next-fit: it resumes after the
+// block handed out last, which keeps a file's blocks together.
+//
+// a growing file also reserves a window of up to RESV_BLOCKS free
+// blocks after its last one (see balloc_ip), so files appended to
+// at the same time don't interleave. reservations live only in
+// memory, in resv, and their blocks are not in nfree. resv bits
+// are set while holding the bitmap block, so a scan of a bitmap
+// block sees every reservation in it.
+//
+// a block freed by a transaction that hasn't committed yet must not
+// be reused: its new contents could reach the disk before the free
+// does, and a crash would leave the old owner pointing at them.
+// bfree keeps it reserved and marks it in pend, fmap_commit hands
+// it out once the log has committed.
 struct{
     lm_lock_t lock;
-    inode_t inode[NINODE];
+    uint_t nbmap;   // bitmap blocks
+    uint_t *nfree;  // free blocks per bitmap block
+    uint_t total;   // free blocks in all
+    uint_t cursor;  // next block to try
+    uchar_t *resv;  // a bit for every block, set if reserved
+    uchar_t *pend;  // a bit for every block freed by the open transaction
+    uint_t *npend;  // pending frees per bitmap block
+    uint_t pending; // pending frees in all
+}fmap;
+
+// in-memory inodes are found through a hash of (dev, inum),
+// every bucket with its own lock, which also protects ref of
+// the inodes on its chain. inodes nobody references stay cached
+// on an LRU list and are recycled from its tail once NINODE
+// inodes exist; until then, and whenever the LRU is empty, iget
+// allocates a new one. misses are serialized by alloc_lock so an
+// inode never gets two copies.
+// lock order: alloc_lock, bucket lock, lru_lock.
+#define NIBUCKET 31
+
+struct ibucket {
+    lm_lock_t lock;
+    inode_t *head; // chain through hnext
+};
+
+struct{
+    struct ibucket bucket[NIBUCKET];
+    lm_lock_t alloc_lock;
+    int n;              // inodes allocated, protected by alloc_lock
+
+    // unreferenced inodes, head.next is most recent
+    lm_lock_t lru_lock;
+    inode_t head;
+
+    struct {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t recycled;
+    } stat;
 }itable;
 
 
@@ -26,91 +82,373 @@ void readsb(int dev, struct superblock *sb){
 }
 
 
+// the bitmap has a bit for every block of the disk
 uint_t get_datastart(){
 
-    uint_t bits = (sb.nblocks)/ (BPB); 
-    uint_t Bs = bits*8;
-    uint_t blocks = (Bs+BSIZE-1)/BSIZE;
+    uint_t blocks = (sb.nblocks + BPB - 1) / BPB;
     return sb.bmapstart + blocks;
 
 }
 
+// count the free blocks of every bitmap block, MAXBRUN bitmap
+// blocks per disk request.
+static void fmap_init(int dev){
+    struct buf *bs[MAXBRUN];
+
+    lm_lockinit(&fmap.lock, "fmap");
+    fmap.nbmap = (sb.nblocks + BPB - 1) / BPB;
+    if((fmap.nfree = mem_malloc(fmap.nbmap * sizeof(uint_t))) == 0)
+        panic("fmap_init");
+    if((fmap.resv = mem_malloc(fmap.nbmap * BSIZE)) == 0 ||
+       (fmap.pend = mem_malloc(fmap.nbmap * BSIZE)) == 0 ||
+       (fmap.npend = mem_malloc(fmap.nbmap * sizeof(uint_t))) == 0)
+        panic("fmap_init");
+    memset(fmap.resv, 0, fmap.nbmap * BSIZE);
+    memset(fmap.pend, 0, fmap.nbmap * BSIZE);
+    memset(fmap.npend, 0, fmap.nbmap * sizeof(uint_t));
+    fmap.pending = 0;
+    fmap.total = 0;
+    fmap.cursor = datastart;
+    for(uint_t k = 0; k < fmap.nbmap; k += MAXBRUN){
+        int n = fmap.nbmap - k < MAXBRUN ? fmap.nbmap - k : MAXBRUN;
+        bget_run(dev, sb.bmapstart + k, n, bs);
+        bread_fill(bs, n);
+        for(int j = 0; j < n; j++){
+            uint_t first = (k + j) * BPB, last = first + BPB;
+            if(first < datastart)
+                first = datastart;
+            if(last > sb.nblocks)
+                last = sb.nblocks;
+            uint_t cnt = 0;
+            for(uint_t b = first; b < last; b++){
+                if((bs[j]->data[(b % BPB)/8] & (1 << (b % 8))) == 0)
+                    cnt++;
+            }
+            fmap.nfree[k + j] = cnt;
+            fmap.total += cnt;
+            brelse(bs[j]);
+        }
+    }
+}
+
+// take a free block's count, from the bitmap block of the cursor
+// or the next one with room. return the bitmap block index and
+// where to start looking in it.
+static uint_t fmap_take(uint_t *start){
+    lm_lock(&fmap.lock);
+    if(fmap.total == 0)
+        panic("balloc: out of blocks");
+    uint_t k = fmap.cursor / BPB;
+    *start = fmap.cursor;
+    while(fmap.nfree[k] == 0){
+        k = (k + 1) % fmap.nbmap;
+        *start = k * BPB;
+    }
+    if(*start < datastart)
+        *start = datastart;
+    fmap.nfree[k]--;
+    fmap.total--;
+    lm_unlock(&fmap.lock);
+    return k;
+}
+
 // should be called in process
 void fs_init(int dev){
     readsb(dev, &sb);
     if(sb.magic != FSMAGIC)
         panic("invalid file system");
+    initlog(dev, &sb);
     datastart = get_datastart();
-    for(int i=0; i<NINODE; i++){
-        lm_sem_init(&itable.inode[i].lock, 1);
+    fmap_init(dev);
+    for(int i=0; i<NIBUCKET; i++){
+        lm_lockinit(&itable.bucket[i].lock, "ibucket");
     }
-    lm_lockinit(&itable.lock, "itable");
-    lm_sem_init(&fs_lock, 1);
-    
+    lm_lockinit(&itable.alloc_lock, "ialloc");
+    lm_lockinit(&itable.lru_lock, "ilru");
+    itable.head.prev = &itable.head;
+    itable.head.next = &itable.head;
 }
 
 
-// return the block number of the first free block
-uint_t balloc(){
-    
-    struct buf *b = NULL;
-    for(uint_t i=datastart; i<sb.nblocks; i++){
-        if(b==NULL || BBLOCK(i, sb) > b->blockno){
-            if(b!=NULL){
-                brelse(b);
-            }
-            b = bread(ROOTDEV ,BBLOCK(i, sb));
-        }
+// the first block in [start, end) of bitmap block b that is
+// neither allocated nor reserved, or end
+static uint_t bfind(struct buf *b, uint_t start, uint_t end){
+    for(uint_t i = start; i < end; i++){
         uint_t bi = i % BPB;
-        uint_t m = 1 << (bi % 8);
-        if((b->data[bi/8] & m) == 0){
-            b->data[bi/8] |= m;
-            bwrite(b);
-            brelse(b);
-            return i;
+        uchar_t used = b->data[bi/8] | fmap.resv[i/8];
+        if(bi % 8 == 0 && used == 0xff && i + 8 <= end){
+            // a full byte
+            i += 7;
+            continue;
         }
+        if((used & (1 << (bi % 8))) == 0)
+            return i;
     }
-    panic("balloc: out of blocks");
-    return -1;
+    return end;
 }
 
+// a new block starts zeroed, bmap relies on it for indirect
+// blocks. the zeroes of a metadata block go through the log, or
+// the flusher could write them home before the transaction that
+// frees the block's old use commits. file data skips the log.
+// it is overwritten whole, no need to read it
+static void bclear(uint_t i, int meta){
+    struct buf *b;
+    bget_run(ROOTDEV, i, 1, &b);
+    memset(b->data, 0, BSIZE);
+    if(meta)
+        log_write(b);
+    else
+        bdirty(b);
+    brelse(b);
+}
 
-// Find the inode with number inum on device dev
-// and return the in-memory copy. Does not lock
-// the inode and does not read it from disk.
-static struct inode*
-iget(uint_t dev, uint_t inum)
+// return the block number of a free block, the first one
+// at or after the cursor. meta if it will hold metadata.
+uint_t balloc(int meta){
+    
+    uint_t start;
+    uint_t k = fmap_take(&start);
+    uint_t end = (k + 1) * BPB < sb.nblocks ? (k + 1) * BPB : sb.nblocks;
+    struct buf *b = bread(ROOTDEV, sb.bmapstart + k);
+
+    // the taken count guarantees a free bit in this bitmap block.
+    // look after start first, then from the beginning of the block
+    uint_t i = bfind(b, start, end);
+    if(i == end && (i = bfind(b, k * BPB < datastart ? datastart : k * BPB, start)) == start)
+        panic("balloc: bitmap and counts disagree");
+    uint_t bi = i % BPB;
+    b->data[bi/8] |= 1 << (bi % 8);
+    log_write(b);
+    brelse(b);
+    lm_lock(&fmap.lock);
+    fmap.cursor = i + 1 < sb.nblocks ? i + 1 : datastart;
+    lm_unlock(&fmap.lock);
+    bclear(i, meta);
+    return i;
+}
+
+// reserve up to RESV_BLOCKS free blocks for ip, the first one
+// at or after goal, preferably goal itself
+static void iresv_fill(inode_t *ip, uint_t goal){
+    uint_t k;
+
+    if(goal < datastart || goal >= sb.nblocks)
+        goal = fmap.cursor;
+    lm_lock(&fmap.lock);
+    if(fmap.total == 0){
+        lm_unlock(&fmap.lock);
+        return;
+    }
+    k = goal / BPB;
+    while(fmap.nfree[k] == 0){
+        k = (k + 1) % fmap.nbmap;
+        goal = k * BPB;
+    }
+    lm_unlock(&fmap.lock);
+    if(goal < datastart)
+        goal = datastart;
+
+    uint_t end = (k + 1) * BPB < sb.nblocks ? (k + 1) * BPB : sb.nblocks;
+    struct buf *b = bread(ROOTDEV, sb.bmapstart + k);
+    lm_lock(&fmap.lock);
+    uint_t i = bfind(b, goal, end);
+    if(i == end)
+        i = bfind(b, k * BPB < datastart ? datastart : k * BPB, goal);
+    uint_t n = 0;
+    while(i + n < end && n < RESV_BLOCKS && n < fmap.nfree[k] &&
+          bfind(b, i + n, i + n + 1) == i + n){
+        fmap.resv[(i + n)/8] |= 1 << ((i + n) % 8);
+        n++;
+    }
+    fmap.nfree[k] -= n;
+    fmap.total -= n;
+    ip->resv.start = i;
+    ip->resv.len = n;
+    if(n > 0)
+        fmap.cursor = i + n < sb.nblocks ? i + n : datastart;
+    lm_unlock(&fmap.lock);
+    brelse(b);
+}
+
+// give back what is left of ip's reservation
+static void iresv_release(inode_t *ip){
+    lm_lock(&fmap.lock);
+    for(uint_t i = ip->resv.start; i < ip->resv.start + ip->resv.len; i++){
+        fmap.resv[i/8] &= ~(1 << (i % 8));
+        fmap.nfree[i / BPB]++;
+        fmap.total++;
+    }
+    ip->resv.len = 0;
+    lm_unlock(&fmap.lock);
+}
+
+// allocate a block for ip, from its reservation window, which is
+// refilled right after its last block. consecutive appends get
+// consecutive blocks even when other files grow at the same time.
+// caller must hold ip->lock
+static uint_t balloc_ip(inode_t *ip, int meta){
+    if(ip->resv.len == 0)
+        iresv_fill(ip, ip->resv.start);
+    lm_lock(&fmap.lock);
+    if(ip->resv.len == 0){
+        lm_unlock(&fmap.lock);
+        return balloc(meta);
+    }
+    uint_t i = ip->resv.start++;
+    ip->resv.len--;
+    lm_unlock(&fmap.lock);
+
+    // the block is ours, nobody else allocates a reserved block
+    struct buf *b = bread(ROOTDEV, BBLOCK(i, sb));
+    uint_t bi = i % BPB;
+    if(b->data[bi/8] & (1 << (bi % 8)))
+        panic("balloc_ip: reserved block in use");
+    b->data[bi/8] |= 1 << (bi % 8);
+    log_write(b);
+    brelse(b);
+    lm_lock(&fmap.lock);
+    fmap.resv[i/8] &= ~(1 << (i % 8));
+    lm_unlock(&fmap.lock);
+    bclear(i, meta);
+    return i;
+}
+
+
+static struct ibucket*
+ihash(uint_t dev, uint_t inum)
 {
-  struct inode *ip, *empty;
+  return &itable.bucket[(dev * 31 + inum) % NIBUCKET];
+}
 
-  lm_lock(&itable.lock);
+// take a reference to ip, off the LRU if it was unreferenced.
+// must hold ip's bucket lock.
+static void
+iref(inode_t *ip)
+{
+  if(ip->ref++ == 0 && ip->onlru){
+    lm_lock(&itable.lru_lock);
+    ip->next->prev = ip->prev;
+    ip->prev->next = ip->next;
+    ip->onlru = 0;
+    lm_unlock(&itable.lru_lock);
+  }
+}
 
-  // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
-      lm_unlock(&itable.lock);
+// find inum on its bucket and take a reference.
+// must hold the bucket lock.
+static inode_t*
+ibucket_get(struct ibucket *bk, uint_t dev, uint_t inum)
+{
+  for(inode_t *ip = bk->head; ip; ip = ip->hnext){
+    if(ip->dev == dev && ip->inum == inum){
+      iref(ip);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
+  return 0;
+}
+
+// an unreferenced inode off the LRU tail and out of its bucket,
+// or 0 if there is none. must hold alloc_lock.
+static inode_t*
+ivictim(void)
+{
+  inode_t *ip;
 
-  // Recycle an inode entry.
-  if(empty == 0)
-    panic("iget: no inodes");
+  for(;;){
+    lm_lock(&itable.lru_lock);
+    ip = itable.head.prev;
+    lm_unlock(&itable.lru_lock);
+    if(ip == &itable.head)
+      return 0;
+
+    // iget and iput may have moved it meanwhile, so check again
+    // under its bucket lock, which both of them hold.
+    struct ibucket *bk = ihash(ip->dev, ip->inum);
+    lm_lock(&bk->lock);
+    lm_lock(&itable.lru_lock);
+    if(ip->ref == 0 && ip->onlru){
+      ip->next->prev = ip->prev;
+      ip->prev->next = ip->next;
+      ip->onlru = 0;
+      lm_unlock(&itable.lru_lock);
+      inode_t **pp = &bk->head;
+      while(*pp != ip)
+        pp = &(*pp)->hnext;
+      *pp = ip->hnext;
+      lm_unlock(&bk->lock);
+      return ip;
+    }
+    lm_unlock(&itable.lru_lock);
+    lm_unlock(&bk->lock);
+  }
+}
+
+// Find the inode with number inum on device dev
+// and return the in-memory copy. Does not lock
+// the inode and does not read it from disk.
+static struct inode*
+iget(uint_t dev, uint_t inum)
+{
+  struct inode *ip;
+  struct ibucket *bk = ihash(dev, inum);
+
+  // Is the inode already cached?
+  lm_lock(&bk->lock);
+  if((ip = ibucket_get(bk, dev, inum)) != 0){
+    lm_unlock(&bk->lock);
+    itable.stat.hits++;
+    return ip;
+  }
+  lm_unlock(&bk->lock);
+
+  // Not cached; only one miss at a time, check again
+  lm_lock(&itable.alloc_lock);
+  lm_lock(&bk->lock);
+  if((ip = ibucket_get(bk, dev, inum)) != 0){
+    lm_unlock(&bk->lock);
+    lm_unlock(&itable.alloc_lock);
+    itable.stat.hits++;
+    return ip;
+  }
+  lm_unlock(&bk->lock);
+
+  // Recycle an unreferenced inode, or make a new one.
+  ip = 0;
+  if(itable.n >= NINODE && (ip = ivictim()) != 0)
+    itable.stat.recycled++;
+  if(ip == 0){
+    if((ip = mem_malloc(sizeof(*ip))) == 0 && (ip = ivictim()) == 0)
+      panic("iget: no inodes");
+    memset(ip, 0, sizeof(*ip));
+    lm_sem_init(&ip->lock, 1);
+    itable.n++;
+  }
+  itable.stat.misses++;
 
-  ip = empty;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
-  lm_unlock(&itable.lock);
+  ip->onlru = 0;
+  lm_lock(&bk->lock);
+  ip->hnext = bk->head;
+  bk->head = ip;
+  lm_unlock(&bk->lock);
+  lm_unlock(&itable.alloc_lock);
 
   return ip;
 }
 
+void
+icache_dump(void)
+{
+  printf("icache: %d inodes, %d hits, %d misses, %d recycled\n",
+         itable.n, (int)itable.stat.hits, (int)itable.stat.misses,
+         (int)itable.stat.recycled);
+}
+
 
 // alloc a new inode corresponding to the given type
 inode_t *ialloc(uint_t dev, uint_t type){
@@ -125,10 +463,12 @@ inode_t *ialloc(uint_t dev, uint_t type){
         }
         struct dinode *dip = (struct dinode *)(b->data) + i%IPB;
         if(dip->type == 0){
-            inode_t *ip = iget(dev, i);
-            ip->type = type;
+            // mark it allocated on the disk
+            memset(dip, 0, sizeof(*dip));
+            dip->type = type;
+            log_write(b);
             brelse(b);
-            return ip;
+            return iget(dev, i);
         }
     }
     return 0;
@@ -144,7 +484,7 @@ int iupdate(inode_t *ip){
     dip->nlink = ip->nlink;
     dip->size = ip->size;
     memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
-    bwrite(bp);
+    log_write(bp);
     brelse(bp);
     return 0;
 
@@ -158,14 +498,58 @@ void bfree(uint_t dev, uint_t b){
         panic("bfree: freeing free block");
     }
     bp->data[bi/8] &= ~m;
-    bwrite(bp);
+    log_write(bp);
+    // reserved until the free commits, set while holding the
+    // bitmap block like every reservation
+    lm_lock(&fmap.lock);
+    fmap.resv[b/8] |= 1 << (b % 8);
+    fmap.pend[b/8] |= 1 << (b % 8);
+    fmap.npend[b / BPB]++;
+    fmap.pending++;
+    lm_unlock(&fmap.lock);
     brelse(bp);
 }
 
+// the transaction that freed the pending blocks has committed,
+// they may be allocated again. called by commit().
+void fmap_commit(void){
+    lm_lock(&fmap.lock);
+    for(uint_t k = 0; k < fmap.nbmap && fmap.pending > 0; k++){
+        if(fmap.npend[k] == 0)
+            continue;
+        for(uint_t i = k * BPB / 8; i < (k + 1) * BPB / 8; i++){
+            fmap.resv[i] &= ~fmap.pend[i];
+            fmap.pend[i] = 0;
+        }
+        fmap.nfree[k] += fmap.npend[k];
+        fmap.total += fmap.npend[k];
+        fmap.pending -= fmap.npend[k];
+        fmap.npend[k] = 0;
+    }
+    lm_unlock(&fmap.lock);
+}
+
+// free the blocks of an indirect table of the given depth,
+// then the table itself
+static void itrunc_table(uint_t dev, uint_t addr, int depth){
+    struct buf *bp = bread(dev, addr);
+    uint_t *a = (uint_t*)bp->data;
+    for(int j=0;j<NINDIRECT;j++){
+        if(a[j] == 0)
+            continue;
+        if(depth > 1)
+            itrunc_table(dev, a[j], depth - 1);
+        else
+            bfree(dev, a[j]);
+    }
+    brelse(bp);
+    bfree(dev, addr);
+}
+
 // truncate the inode
+// caller must hold ip->lock
 int itrunc(inode_t *ip){
 
-    lm_P(&ip->lock);
     for(int i=0;i<NDIRECT;i++){
         if(ip->addrs[i]){
             bfree(ROOTDEV, ip->addrs[i]);
@@ -173,20 +557,19 @@ int itrunc(inode_t *ip){
         }
     }
     if(ip->addrs[NDIRECT]){
-        struct buf *bp = bread(ROOTDEV, ip->addrs[NDIRECT]);
-        uint_t *a = (uint_t*)bp->data;
-        for(int j=0;j<NINDIRECT;j++){
-            if(a[j]){
-                bfree(ROOTDEV, a[j]);
-            }
-        }
-        brelse(bp);
-        bfree(ROOTDEV, ip->addrs[NDIRECT]);
+        itrunc_table(ip->dev, ip->addrs[NDIRECT], 1);
         ip->addrs[NDIRECT] = 0;
     }
+    if(ip->addrs[NDIRECT+1]){
+        itrunc_table(ip->dev, ip->addrs[NDIRECT+1], 2);
+        ip->addrs[NDIRECT+1] = 0;
+    }
+    iresv_release(ip);
+    ip->resv.start = 0;
+    ip->ext.len = 0;
     ip->size = 0;
     iupdate(ip);
-    lm_V(&ip->lock);
+    pcache_invalidate(ip);
     return 0;
 
 
@@ -209,6 +592,7 @@ int ilock(inode_t *ip){
         ip->size = dip->size;
         memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
         brelse(bp);
+        ip->ext.len = 0;
         ip->valid = 1;
         if(ip->type == 0)
             panic("ilock: no type");
@@ -229,26 +613,44 @@ int iunlock(inode_t *ip){
 
 
 
-// decrease the reference count of the inode
+// decrease the reference count of the inode.
+// must be called inside a transaction in case it has to free the inode.
 int iput(inode_t *ip){
     
 
-    lm_lock(&itable.lock);
+    struct ibucket *bk = ihash(ip->dev, ip->inum);
+
+    lm_lock(&bk->lock);
     if(ip->ref == 1 && ip->valid && ip->nlink == 0){
         // inode has no links and no other references: truncate and free.
+        // ref == 1 means no other task can have ip locked,
+        // so this lm_P won't block (or deadlock).
         lm_P(&ip->lock);
+        lm_unlock(&bk->lock);
 
         itrunc(ip);
         ip->type = 0;
         iupdate(ip);
         ip->valid = 0;
+        dcache_forget(ip->dev, ip->inum);
         lm_V(&ip->lock);
-        lm_unlock(&itable.lock);
-        return 0;
+        lm_lock(&bk->lock);
     }
 
     ip->ref--;
-    lm_unlock(&itable.lock);
+    if(ip->ref == 0){
+        // the inode may be recycled for another one
+        iresv_release(ip);
+        ip->resv.start = 0;
+        lm_lock(&itable.lru_lock);
+        ip->next = itable.head.next;
+        ip->prev = &itable.head;
+        itable.head.next->prev = ip;
+        itable.head.next = ip;
+        ip->onlru = 1;
+        lm_unlock(&itable.lru_lock);
+    }
+    lm_unlock(&bk->lock);
     return 0;
 }
 
@@ -260,91 +662,166 @@ int iunlockput(inode_t *ip){
 
 }
 
-// return the no.start bmap
-uint_t bmap(inode_t *ip, uint_t start){
+// map up to max entries of table a from entry i, allocating the
+// missing ones with alloc. set *addr to the first block and return
+// how many of them follow it consecutively on disk.
+static int table_run(inode_t *ip, uint_t *a, uint_t i, int max, int alloc, uint_t *addr, int *changed){
+    int n;
+    for(n = 0; i < NINDIRECT && n < max; i++, n++){
+        if(a[i] == 0){
+            if(!alloc)
+                break;
+            a[i] = balloc_ip(ip, ip->type == T_DIR);
+            *changed = 1;
+        }
+        if(n == 0)
+            *addr = a[i];
+        else if(a[i] != *addr + n)
+            break;
+    }
+    return n;
+}
 
-    if(start>=MAXFILE)
-        return -1;
+// entry i of the indirect block at addr, allocating it with alloc.
+// return 0 if it isn't there.
+static uint_t table_get(inode_t *ip, uint_t addr, uint_t i, int alloc){
+    struct buf *bp = bread(ip->dev, addr);
+    uint_t *a = (uint_t*)bp->data;
+    if(a[i] == 0 && alloc){
+        a[i] = balloc_ip(ip, 1);
+        log_write(bp);
+    }
+    addr = a[i];
+    brelse(bp);
+    return addr;
+}
 
-    uint_t end_block = ip->size/BSIZE+1;
-
-    if(end_block < start){
-        // append
-        if(end_block<NDIRECT){
-            uint_t high = start<NDIRECT?start:NDIRECT;
-            for(uint_t i=end_block; i<high; i++){
-                uint_t addr = balloc();
-                if(addr == 0){
-                    return -1;
-                }
-                ip->addrs[i] = addr;
-            }
-            if(high >= start){
-                return ip->addrs[start];
-            }
+// the number of blocks from block bn of ip, at most max, that
+// sit in consecutive disk blocks starting at *addr, or 0 when
+// bn has no block and alloc is 0.
+// the last extent found is remembered in ip->ext, so reading a
+// contiguous file again needs no indirect block. otherwise a run
+// costs one read of its indirect block, not one per block.
+static int bmap_run(inode_t *ip, uint_t bn, int max, int alloc, uint_t *addr){
+    struct extent *e = &ip->ext;
+    uint_t table;
+    int n, changed = 0;
+
+    if(e->len && bn >= e->lbn && bn < e->lbn + e->len){
+        *addr = e->pbn + (bn - e->lbn);
+        n = e->lbn + e->len - bn;
+        return n < max ? n : max;
+    }
+
+    if(bn < NDIRECT){
+        if(max > NDIRECT - bn)
+            max = NDIRECT - bn;
+        n = table_run(ip, ip->addrs, bn, max, alloc, addr, &changed);
+        // the caller writes the inode
+        goto found;
+    }
+    bn -= NDIRECT;
+
+    if(bn < NINDIRECT){
+        // load indirect block, allocating if necessary.
+        if((table = ip->addrs[NDIRECT]) == 0){
+            if(!alloc)
+                return 0;
+            table = ip->addrs[NDIRECT] = balloc_ip(ip, 1);
         }
-        // append indirect
-        if(ip->addrs[NDIRECT] == 0){
-            uint_t addr = balloc();
-            if(addr == 0){
-                panic("bmap: balloc");
-                return -1;
-            }
-            ip->addrs[NDIRECT] = addr;
+        bn += NDIRECT;
+    } else {
+        bn -= NINDIRECT;
+        if(bn >= NINDIRECT*NINDIRECT)
+            panic("bmap: out of range");
+        // double indirect, then the indirect block it points to
+        if((table = ip->addrs[NDIRECT+1]) == 0){
+            if(!alloc)
+                return 0;
+            table = ip->addrs[NDIRECT+1] = balloc_ip(ip, 1);
         }
-        struct buf *bp = bread(ip->dev, ip->addrs[NDIRECT]);
-        for(uint_t i=NDIRECT; i<=start; i++){
-            if(((uint_t*)bp->data)[i - NDIRECT] != 0)
-                continue;
-            uint_t addr = balloc();
-            if(addr == 0){
-                panic("bmap: balloc");
-                return -1;
-            }
-            ((uint_t*)bp->data)[i - NDIRECT] = addr;
+        if((table = table_get(ip, table, bn / NINDIRECT, alloc)) == 0)
+            return 0;
+        bn += NDIRECT + NINDIRECT;
+    }
 
-        }
-        uint_t baddr= ((uint_t*)bp->data)[start - NDIRECT];
-        brelse(bp);
-        return baddr;
+    uint_t i = (bn - NDIRECT) % NINDIRECT;
+    struct buf *bp = bread(ip->dev, table);
+    n = table_run(ip, (uint_t*)bp->data, i, max, alloc, addr, &changed);
+    if(changed)
+        log_write(bp);
+    brelse(bp);
 
-    }else{
-        
-        if(start<NDIRECT){
-            return ip->addrs[start];
-        }
-        else{    
-            struct buf *bp = bread(ip->dev, ip->addrs[NDIRECT]);
-            uint_t baddr= ((uint_t*)bp->data)[start - NDIRECT];
-            brelse(bp);
-            return baddr;
-        }
+found:
+    if(n == 0)
+        return 0;
+    if(e->len && bn == e->lbn + e->len && *addr == e->pbn + e->len){
+        e->len += n;
+    } else {
+        e->lbn = bn;
+        e->pbn = *addr;
+        e->len = n;
     }
-    panic("bmap: out of range");
-    return 0;
+    return n;
+}
+
+// return the disk block of the no.bn block of ip,
+// allocating it if it doesn't exist yet
+uint_t bmap(inode_t *ip, uint_t bn){
+    uint_t addr;
+    if(bmap_run(ip, bn, 1, 1, &addr) == 0)
+        return 0;
+    return addr;
 }
 
 int writei(inode_t *ip, int user_src, uint64_t src, uint_t off, uint_t n){
     uint_t tot, m;
-    struct buf *bp;
+    struct buf *bs[MAXBRUN];
 
     if(off > ip->size || off + n < off)
         return -1;
     if(off + n > MAXFILE*BSIZE)
         return -1;
 
-    for(tot=0; tot<n; tot+=m, off+=m, src+=m){
-        uint_t addr = bmap(ip, off/BSIZE);
-        if(addr == 0)
-            break;
-        bp = bread(ip->dev, addr);
-        m = (n-tot) < (BSIZE - off%BSIZE) ? (n-tot) : (BSIZE - off%BSIZE);
-        if(either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1) {
-            brelse(bp);
+    for(tot=0; tot<n; ){
+        // write up to MAXBRUN contiguous blocks with one request
+        uint_t bn = off/BSIZE;
+        uint_t nblocks = (off + (n-tot) + BSIZE - 1)/BSIZE - bn;
+        uint_t addr;
+        int run = bmap_run(ip, bn, nblocks < MAXBRUN ? nblocks : MAXBRUN, 1, &addr);
+        if(run == 0)
             break;
+        bget_run(ip->dev, addr, run, bs);
+
+        // blocks written only in part need their old contents
+        if(off % BSIZE)
+            bread_fill(bs, 1);
+        uint_t end = off + (n-tot);
+        if(end < (bn + run) * BSIZE)
+            bread_fill(bs + run - 1, 1);
+
+        int i, done = 0;
+        for(i = 0; i < run; i++, tot+=m, off+=m, src+=m){
+            m = (n-tot) < (BSIZE - off%BSIZE) ? (n-tot) : (BSIZE - off%BSIZE);
+            if(either_copyin(bs[i]->data + (off % BSIZE), user_src, src, m) == -1) {
+                done = 1;
+                break;
+            }
+            bs[i]->valid = 1;
+            // keep the pages mapped from the page cache up to date
+            pcache_write(ip, off, bs[i]->data + (off % BSIZE), m);
         }
-
-        brelse(bp);
+        // directories are metadata, file data skips the log
+        for(int j = 0; j < i; j++){
+            if(ip->type == T_DIR)
+                log_write(bs[j]);
+            else
+                bdirty(bs[j]);
+        }
+        for(int j = 0; j < run; j++)
+            brelse(bs[j]);
+        if(done)
+            break;
     }
 
     if(off > ip->size)
@@ -360,32 +837,85 @@ int writei(inode_t *ip, int user_src, uint64_t src, uint_t off, uint_t n){
 
 int readi(inode_t *ip, int user_dst, uint64_t dst, uint_t off, uint_t n){
     uint_t tot, m;
-    struct buf *bp;
+    struct buf *bs[MAXBRUN];
 
     if(off > ip->size || off + n < off || off + n > MAXFILE*BSIZE)
         return -1;
-
-
-    for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-        uint_t addr = bmap(ip, off/BSIZE);
-        if(addr == 0)
-            break;
-        bp = bread(ip->dev, addr);
-        m= (BSIZE - off%BSIZE) <( n - tot) ? (BSIZE - off%BSIZE) : (n - tot);
-        if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
-            brelse(bp);
+    if(off + n > ip->size)
+        n = ip->size - off;
+
+    for(tot=0; tot<n; ){
+        // read up to MAXBRUN contiguous blocks with one request
+        uint_t bn = off/BSIZE;
+        uint_t nblocks = (off + (n-tot) + BSIZE - 1)/BSIZE - bn;
+        uint_t addr;
+        int run = bmap_run(ip, bn, nblocks < MAXBRUN ? nblocks : MAXBRUN, 0, &addr);
+        if(run == 0)
             break;
+        bget_run(ip->dev, addr, run, bs);
+        bread_fill(bs, run);
+
+        int done = 0;
+        for(int i = 0; i < run; i++, tot+=m, off+=m, dst+=m){
+            m= (BSIZE - off%BSIZE) <( n - tot) ? (BSIZE - off%BSIZE) : (n - tot);
+            if(either_copyout(user_dst, dst, bs[i]->data + (off % BSIZE), m) == -1) {
+                done = 1;
+                break;
+            }
         }
-        brelse(bp);
+        for(int i = 0; i < run; i++)
+            brelse(bs[i]);
+        if(done)
+            break;
     }
 
     return tot;
 }
 
+// called after reading n bytes at off through ra's open file.
+// when the reads look sequential, keep the next ra->win blocks
+// on their way into the buffer cache. the window doubles with
+// every sequential read up to RA_MAX and closes on a seek.
+// caller must hold ip->lock.
+void ireadahead(inode_t *ip, struct readahead *ra, uint_t off, uint_t n){
+    uint_t first = off/BSIZE;
+    uint_t last = (off + n - 1)/BSIZE;
+
+    if(first == ra->next || (ra->next > 0 && first == ra->next - 1)){
+        // continues where the last read stopped
+        ra->win = ra->win ? ra->win * 2 : RA_MIN;
+        if(ra->win > RA_MAX)
+            ra->win = RA_MAX;
+    } else {
+        ra->win = 0;
+        ra->ahead = 0;
+    }
+    ra->next = last + 1;
+    if(ra->win == 0)
+        return;
+
+    uint_t start = ra->ahead > last + 1 ? ra->ahead : last + 1;
+    uint_t end = last + 1 + ra->win;
+    uint_t fileblocks = (ip->size + BSIZE - 1)/BSIZE;
+    if(end > fileblocks)
+        end = fileblocks;
+    while(start < end){
+        uint_t addr;
+        uint_t max = end - start < MAXBRUN ? end - start : MAXBRUN;
+        int run = bmap_run(ip, start, max, 0, &addr);
+        if(run == 0)
+            break;
+        breadahead(ip->dev, addr, run);
+        start += run;
+    }
+    ra->ahead = start;
+}
+
 inode_t *idup(inode_t *ip){
-    lm_lock(&itable.lock);
-    ip->ref++;
-    lm_unlock(&itable.lock);
+    struct ibucket *bk = ihash(ip->dev, ip->inum);
+    lm_lock(&bk->lock);
+    iref(ip);
+    lm_unlock(&bk->lock);
     return ip;
 }
 
@@ -435,6 +965,7 @@ int namecmp(const char *s, const char *t){
 
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
+// Without poff the name cache may answer instead of a scan.
 struct inode*
 dirlookup(struct inode *dp, char *name, uint_t *poff)
 {
@@ -444,6 +975,9 @@ dirlookup(struct inode *dp, char *name, uint_t *poff)
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
+  if(poff == 0 && dcache_lookup(dp->dev, dp->inum, name, &inum))
+    return inum ? iget(dp->dev, inum) : 0;
+
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, 0, (uint64_t)&de, off, sizeof(de)) != sizeof(de))
       panic("dirlookup read");
@@ -454,10 +988,12 @@ dirlookup(struct inode *dp, char *name, uint_t *poff)
       if(poff)
         *poff = off;
       inum = de.inum;
+      dcache_enter(dp->dev, dp->inum, name, inum);
       return iget(dp->dev, inum);
     }
   }
 
+  dcache_enter(dp->dev, dp->inum, name, 0);
   return 0;
 }
 
@@ -514,13 +1050,36 @@ nameiparent(char *path, char *name)
   return namex(path, 1, name);
 }
 
+// remove the entry of name at off from dp. entries fill
+// [0, dp->size) without holes, dirlink relies on it, so the
+// last entry moves into the hole.
+// caller must hold dp->lock and be in a transaction.
+void dirunlink(inode_t *dp, char *name, uint_t off){
+    struct dirent de;
+    uint_t last = dp->size - sizeof(de);
+
+    if(off != last){
+        if(readi(dp, 0, (uint64_t)&de, last, sizeof(de)) != sizeof(de) ||
+           writei(dp, 0, (uint64_t)&de, off, sizeof(de)) != sizeof(de))
+            panic("dirunlink");
+    }
+    memset(&de, 0, sizeof(de));
+    if(writei(dp, 0, (uint64_t)&de, last, sizeof(de)) != sizeof(de))
+        panic("dirunlink");
+    dp->size = last;
+    iupdate(dp);
+    dcache_enter(dp->dev, dp->inum, name, 0);
+}
+
 int dirlink(inode_t *dip, char *name, int inum){
 
 
     panic_on(dip->type != T_DIR, "add link in non dir");
 
-    if(dirlookup(dip, name, NULL)!=0){
+    inode_t *ip;
+    if((ip = dirlookup(dip, name, NULL))!=0){
         printf("entry exist\n");
+        iput(ip);
         return -1;
     }
 
@@ -533,7 +1092,7 @@ int dirlink(inode_t *dip, char *name, int inum){
                 ndirect++;
             }           
             if(dip->addrs[ndirect] == 0){
-                dip->addrs[ndirect] = balloc();
+                dip->addrs[ndirect] = balloc(1);
             }
             b = bread(dip->dev, dip->addrs[ndirect]);
         }
@@ -542,8 +1101,10 @@ int dirlink(inode_t *dip, char *name, int inum){
             d->inum = inum;
             strncpy(d->name, name, sizeof(d->name));
             dip->size += sizeof(struct dirent);
+            log_write(b);
             brelse(b);
             iupdate(dip);
+            dcache_enter(dip->dev, dip->inum, name, inum);
             return 0;
         }
         
@@ -554,12 +1115,3 @@ int dirlink(inode_t *dip, char *name, int inum){
     return -1;
 
 }
-
-void begin_op(){
-    // start a transaction
-    lm_P(&fs_lock);
-}   
-
-void end_op(){
-    lm_V(&fs_lock);
-}
\ No newline at end of file
@@ -7,7 +7,7 @@
 #define BSIZE 1024  // block size
 
 // Disk layout:
-// [ boot block | super block | inode blocks |
+// [ boot block | super block | log | inode blocks |
 //                                          free bit map | data blocks]
 //
 // mkfs computes the super block and builds an initial file system. The
@@ -19,13 +19,15 @@ struct superblock {
   uint_t ninodes;      // Number of inodes.
   uint_t inodestart;   // Block number of first inode block
   uint_t bmapstart;    // Block number of first free map block
+  uint_t nlog;         // Number of log blocks
+  uint_t logstart;     // Block number of first log block
 };
 
 #define FSMAGIC 0x0048525a
 
-#define NDIRECT 12
+#define NDIRECT 11
 #define NINDIRECT (BSIZE / sizeof(uint_t))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define MAXFILE (NDIRECT + NINDIRECT + NINDIRECT*NINDIRECT)
 
 enum {
   T_NONE = 0, // None
@@ -41,9 +43,10 @@ struct dinode {
   short minor;          // Minor device number (T_DEVICE only)
   short nlink;          // Number of links to inode in file system
   uint_t size;            // Size of file (bytes)
-  uint_t addrs[NDIRECT+1];   // Data block addresses, the last one is indirect block
+  uint_t addrs[NDIRECT+2];   // Data block addresses, then the indirect and the double indirect block
 };
-// indirect block contains block numbers of data blocks
+// indirect block contains block numbers of data blocks,
+// double indirect block contains block numbers of indirect blocks
 
 // Inodes per block.
 #define IPB           (BSIZE / sizeof(struct dinode))
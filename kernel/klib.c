@@ -5,10 +5,11 @@
 #include <stddef.h>
 #include <stdarg.h>
 
-static char buf[4096];
-
 static int kernel_debug=1;
 
+// set by panic, makes the uart write synchronously
+volatile int panicked;
+
 static void putstr(const char *s)
 {
   while (*s)
@@ -20,6 +21,7 @@ static void putstr(const char *s)
 
 void panic(const char *s)
 {
+    panicked = 1;
     printf("panic: %s\n",s);
     while(1);
 }
@@ -335,36 +337,164 @@ int strncmp(const char *s1, const char *s2, size_t n) {
   }
 }
 
+// memcpy, memmove and memset work a 64-bit word at a time, eight
+// words per loop, once the pointers are aligned. memcpy needs src
+// and dst equally aligned for that, otherwise it copies bytes.
+// built with RVV=1, copies and fills of RVV_MIN bytes or more use
+// the vector unit when start() found one on the hart. the kernel
+// doesn't save vector registers, so the unit is only turned on for
+// the copy, with interrupts off. user programs run with it off and
+// can't use vector instructions: they trap as illegal.
+
+// set by start() when the harts have the vector extension
+int has_rvv;
+
+#define RVV_MIN 256
+
+#ifdef RVV
+static void
+vector_on(void)
+{
+  push_off();
+  w_sstatus(r_sstatus() | SSTATUS_VS_INITIAL);
+}
+
+static void
+vector_off(void)
+{
+  w_sstatus(r_sstatus() & ~SSTATUS_VS_MASK);
+  pop_off();
+}
+
+static void
+memcpy_rvv(uint8_t *d, const uint8_t *s, size_t n)
+{
+  vector_on();
+  asm volatile(
+    "1:\n"
+    "vsetvli t0, %2, e8, m8, ta, ma\n"
+    "vle8.v v0, (%1)\n"
+    "add %1, %1, t0\n"
+    "sub %2, %2, t0\n"
+    "vse8.v v0, (%0)\n"
+    "add %0, %0, t0\n"
+    "bnez %2, 1b\n"
+    : "+r" (d), "+r" (s), "+r" (n)
+    :
+    : "t0", "v0", "v1", "v2", "v3", "v4", "v5", "v6", "v7", "memory");
+  vector_off();
+}
+
+static void
+memset_rvv(uint8_t *d, uint8_t c, size_t n)
+{
+  vector_on();
+  asm volatile(
+    "vsetvli t0, zero, e8, m8, ta, ma\n"
+    "vmv.v.x v0, %2\n"
+    "1:\n"
+    "vsetvli t0, %1, e8, m8, ta, ma\n"
+    "vse8.v v0, (%0)\n"
+    "add %0, %0, t0\n"
+    "sub %1, %1, t0\n"
+    "bnez %1, 1b\n"
+    : "+r" (d), "+r" (n)
+    : "r" (c)
+    : "t0", "v0", "v1", "v2", "v3", "v4", "v5", "v6", "v7", "memory");
+  vector_off();
+}
+#endif
+
 void *memset(void *s, int c, size_t n) {
-  char *p = s;
-  char cc = (char)(c%256);
-  for(size_t i=0;i<n;i++){
+  uint8_t *p = s;
+  uint8_t cc = (uint8_t)c;
+
+#ifdef RVV
+  if(has_rvv && n >= RVV_MIN){
+    memset_rvv(p, cc, n);
+    return s;
+  }
+#endif
+  while(n > 0 && ((uint64_t)p & 7)){
     *p++ = cc;
+    n--;
+  }
+  uint64_t w = cc * 0x0101010101010101ull;
+  uint64_t *pw = (uint64_t*)p;
+  for(; n >= 64; n -= 64, pw += 8){
+    pw[0] = w; pw[1] = w; pw[2] = w; pw[3] = w;
+    pw[4] = w; pw[5] = w; pw[6] = w; pw[7] = w;
   }
+  for(; n >= 8; n -= 8)
+    *pw++ = w;
+  p = (uint8_t*)pw;
+  while(n-- > 0)
+    *p++ = cc;
   return s;
 }
 
-void *memmove(void *dst, const void *src, size_t n) {
-  
+void *memcpy(void *out, const void *in, size_t n) {
+  uint8_t *d = out;
+  const uint8_t *s = in;
 
-  size_t i=0;
-  while(n){
-    size_t len = n>1024?1024:n;
-    memcpy(buf, src+i, len);
-    memcpy(dst+i, buf, len);
-    n-=len;
-    i+=len;
+#ifdef RVV
+  if(has_rvv && n >= RVV_MIN){
+    memcpy_rvv(d, s, n);
+    return out;
   }
-  return dst;
+#endif
+  if((((uint64_t)d ^ (uint64_t)s) & 7) == 0){
+    while(n > 0 && ((uint64_t)d & 7)){
+      *d++ = *s++;
+      n--;
+    }
+    uint64_t *dw = (uint64_t*)d;
+    const uint64_t *sw = (const uint64_t*)s;
+    for(; n >= 64; n -= 64, dw += 8, sw += 8){
+      uint64_t a0 = sw[0], a1 = sw[1], a2 = sw[2], a3 = sw[3];
+      uint64_t a4 = sw[4], a5 = sw[5], a6 = sw[6], a7 = sw[7];
+      dw[0] = a0; dw[1] = a1; dw[2] = a2; dw[3] = a3;
+      dw[4] = a4; dw[5] = a5; dw[6] = a6; dw[7] = a7;
+    }
+    for(; n >= 8; n -= 8)
+      *dw++ = *sw++;
+    d = (uint8_t*)dw;
+    s = (const uint8_t*)sw;
+  }
+  for(; n >= 4; n -= 4, d += 4, s += 4){
+    d[0] = s[0]; d[1] = s[1]; d[2] = s[2]; d[3] = s[3];
+  }
+  while(n-- > 0)
+    *d++ = *s++;
+  return out;
 }
 
-void *memcpy(void *out, const void *in, size_t n) {
-  uint8_t *pout=out;
-  const uint8_t* pin = in;
-  for(size_t i=0;i<n;i++){
-    *pout++ = *pin++;
+// a forward copy is safe unless dst starts inside src
+void *memmove(void *dst, const void *src, size_t n) {
+  uint8_t *d = dst;
+  const uint8_t *s = src;
+
+  if(d <= s || s + n <= d)
+    return memcpy(dst, src, n);
+
+  // copy backwards
+  d += n;
+  s += n;
+  if((((uint64_t)d ^ (uint64_t)s) & 7) == 0){
+    while(n > 0 && ((uint64_t)d & 7)){
+      *--d = *--s;
+      n--;
+    }
+    uint64_t *dw = (uint64_t*)d;
+    const uint64_t *sw = (const uint64_t*)s;
+    for(; n >= 8; n -= 8)
+      *--dw = *--sw;
+    d = (uint8_t*)dw;
+    s = (const uint8_t*)sw;
   }
-  return out;
+  while(n-- > 0)
+    *--d = *--s;
+  return dst;
 }
 
 int memcmp(const void *s1, const void *s2, size_t n) {
@@ -183,6 +183,18 @@ void lm_P(semophore_t *sem){
 
 }
 
+// lm_P without waiting: return 1 if it took sem, 0 if sem is taken
+int lm_P_try(semophore_t *sem){
+    int ok;
+
+    lm_lock(&sem->lk);
+    ok = sem->value > 0;
+    if(ok)
+        sem->value--;
+    lm_unlock(&sem->lk);
+    return ok;
+}
+
 void lm_V(semophore_t *sem){
 
     lm_lock(&sem->lk);
@@ -201,7 +213,7 @@ void lm_V(semophore_t *sem){
         mem_free(tl);
         // wake up
         lm_lock(&t->lock);
-        t->state = RUNNABLE;
+        make_runnable(t);
         lm_unlock(&t->lock);
         lm_unlock(&sem->lk);
     }else{
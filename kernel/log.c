@@ -0,0 +1,274 @@
+// write-ahead log
+// metadata changes of every file system call go to the log first and
+// reach their home blocks only after a commit, so a crash leaves either
+// all or none of a call's changes.
+//
+// a system call brackets its changes with begin_op() and end_op().
+// calls run concurrently, and the log commits once none is left
+// running, so the changes of all calls that overlapped are absorbed
+// into one commit: a block modified by several of them is logged once.
+// begin_op() waits while a commit is going on or while the log has no
+// room left for another call's MAXOPBLOCKS.
+//
+// file data blocks are not logged, they go through the buffer cache's
+// delayed write-back.
+//
+// on-disk format:
+//   header block, the count and block numbers of the logged blocks
+//   the logged blocks
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "fs.h"
+#include "buf.h"
+#include "lock.h"
+
+// both in memory and on disk
+struct logheader {
+  int n;
+  int block[LOGSIZE]; // sorted
+};
+
+struct {
+  lm_lock_t lock;
+  int start;
+  int size;
+  int outstanding; // how many calls are executing
+  int committing;  // in commit(), please wait
+  int dev;
+  struct logheader lh;
+  struct buf *bufs[LOGSIZE]; // held by write_log and install_trans
+
+  struct {
+    uint64_t ops;
+    uint64_t commits;
+    uint64_t blocks;   // logged
+    uint64_t absorbed; // log_write of a block already in the log
+  } stat;
+} log;
+
+static void recover_from_log(void);
+static void commit(void);
+
+void
+initlog(int dev, struct superblock *sb)
+{
+  if(sizeof(struct logheader) >= BSIZE)
+    panic("initlog: too big logheader");
+  if(sb->nlog < LOGSIZE + 1)
+    panic("initlog: log too small");
+
+  lm_lockinit(&log.lock, "log");
+  log.start = sb->logstart;
+  log.size = sb->nlog;
+  log.dev = dev;
+  recover_from_log();
+}
+
+// write the logged blocks to their home locations, in runs of
+// consecutive blocks. every run is started before any is waited
+// for. when committing the blocks are pinned in the cache, when
+// recovering they are copied from the log first.
+static void
+install_trans(int recovering)
+{
+  struct buf **bs = log.bufs;
+  int n = log.lh.n, run = 0;
+
+  for(int i = 0; i <= n; i++){
+    if(i > run && (i == n || i - run == MAXBRUN ||
+                   log.lh.block[i] != log.lh.block[i-1] + 1)){
+      bwrite_start(bs + run, i - run);
+      run = i;
+    }
+    if(i == n)
+      break;
+    bs[i] = bread(log.dev, log.lh.block[i]);
+    if(recovering){
+      struct buf *lbuf = bread(log.dev, log.start + i + 1);
+      memmove(bs[i]->data, lbuf->data, BSIZE);
+      brelse(lbuf);
+    }
+  }
+  bwrite_wait(bs, n);
+  for(int i = 0; i < n; i++){
+    if(!recovering)
+      bunpin(bs[i]);
+    brelse(bs[i]);
+  }
+}
+
+// read the log header from disk into the in-memory log header
+static void
+read_head(void)
+{
+  struct buf *buf = bread(log.dev, log.start);
+  struct logheader *lh = (struct logheader *) (buf->data);
+  log.lh.n = lh->n;
+  for(int i = 0; i < log.lh.n; i++)
+    log.lh.block[i] = lh->block[i];
+  brelse(buf);
+}
+
+// write the in-memory log header to disk.
+// this is the true point at which the current transaction commits.
+static void
+write_head(void)
+{
+  struct buf *buf = bread(log.dev, log.start);
+  struct logheader *hb = (struct logheader *) (buf->data);
+  hb->n = log.lh.n;
+  for(int i = 0; i < log.lh.n; i++)
+    hb->block[i] = log.lh.block[i];
+  bwrite(buf);
+  brelse(buf);
+}
+
+static void
+recover_from_log(void)
+{
+  read_head();
+  if(log.lh.n > 0)
+    printf("log: recovering %d blocks\n", log.lh.n);
+  install_trans(1); // if committed, copy from log to disk
+  log.lh.n = 0;
+  write_head(); // clear the log
+}
+
+// called at the start of each FS system call.
+void
+begin_op(void)
+{
+  lm_lock(&log.lock);
+  while(1){
+    if(log.committing){
+      sleep(&log, &log.lock);
+    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+      // this op might exhaust log space; wait for commit.
+      sleep(&log, &log.lock);
+    } else {
+      log.outstanding += 1;
+      log.stat.ops++;
+      lm_unlock(&log.lock);
+      break;
+    }
+  }
+}
+
+// called at the end of each FS system call.
+// commits if this was the last outstanding operation.
+void
+end_op(void)
+{
+  int do_commit = 0;
+
+  lm_lock(&log.lock);
+  log.outstanding -= 1;
+  if(log.committing)
+    panic("log.committing");
+  if(log.outstanding == 0){
+    do_commit = 1;
+    log.committing = 1;
+  } else {
+    // begin_op() may be waiting for log space,
+    // and decrementing log.outstanding has decreased
+    // the amount of reserved space.
+    wakeup(&log);
+  }
+  lm_unlock(&log.lock);
+
+  if(do_commit){
+    // call commit w/o holding locks, since not allowed
+    // to sleep with locks.
+    commit();
+    lm_lock(&log.lock);
+    log.committing = 0;
+    wakeup(&log);
+    lm_unlock(&log.lock);
+  }
+}
+
+// copy the modified blocks from the cache to the log,
+// MAXBRUN blocks per disk request, all started before
+// waiting for any.
+static void
+write_log(void)
+{
+  struct buf **to = log.bufs;
+
+  for(int i = 0; i < log.lh.n; i += MAXBRUN){
+    int n = log.lh.n - i < MAXBRUN ? log.lh.n - i : MAXBRUN;
+    // the log blocks are overwritten whole, no need to read them
+    bget_run(log.dev, log.start + i + 1, n, to + i);
+    for(int j = i; j < i + n; j++){
+      struct buf *from = bread(log.dev, log.lh.block[j]); // cache block
+      memmove(to[j]->data, from->data, BSIZE);
+      to[j]->valid = 1;
+      brelse(from);
+    }
+    bwrite_start(to + i, n);
+  }
+  bwrite_wait(to, log.lh.n);
+  for(int i = 0; i < log.lh.n; i++)
+    brelse(to[i]);
+}
+
+static void
+commit(void)
+{
+  if(log.lh.n > 0){
+    write_log();     // write modified blocks from cache to log
+    write_head();    // write header to disk -- the real commit
+    install_trans(0); // now install writes to home locations
+    log.stat.commits++;
+    log.stat.blocks += log.lh.n;
+    log.lh.n = 0;
+    write_head();    // erase the transaction from the log
+  }
+  fmap_commit();     // blocks it freed may be reused now
+}
+
+// caller has modified b->data and is done with the buffer.
+// record the block number and pin in the cache by increasing refcnt.
+// commit()/write_log() will do the disk write.
+//
+// log_write() replaces bwrite() and bdirty() for metadata; a typical use is:
+//   bp = bread(...)
+//   modify bp->data[]
+//   log_write(bp)
+//   brelse(bp)
+void
+log_write(struct buf *b)
+{
+  int i;
+
+  lm_lock(&log.lock);
+  if(log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+    panic("too big a transaction");
+  if(log.outstanding < 1)
+    panic("log_write outside of trans");
+
+  // keep the header sorted, so blocks are installed in disk order
+  for(i = 0; i < log.lh.n && log.lh.block[i] < b->blockno; i++)
+    ;
+  if(i < log.lh.n && log.lh.block[i] == b->blockno){
+    // log absorption
+    log.stat.absorbed++;
+  } else {
+    for(int j = log.lh.n; j > i; j--)
+      log.lh.block[j] = log.lh.block[j-1];
+    log.lh.block[i] = b->blockno;
+    log.lh.n++;
+    b->valid = 1;
+    bpin(b);
+  }
+  lm_unlock(&log.lock);
+}
+
+void
+log_dump(void)
+{
+  printf("log: %d ops, %d commits, %d blocks logged, %d absorbed\n",
+         (int)log.stat.ops, (int)log.stat.commits,
+         (int)log.stat.blocks, (int)log.stat.absorbed);
+}
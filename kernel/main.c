@@ -53,6 +53,54 @@ void btest(void*){
     while(1);
 }
 
+#ifdef MEMBENCH
+// bytes per cycle of memcpy, memmove and memset for each size
+// class, build with MEMBENCH=1 (and RVV=1 for the vector ones).
+// "memcpy+1" copies between differently aligned buffers.
+static void report(char *what, int size, uint64_t bytes, uint64_t cycles){
+    uint64_t x100 = cycles ? bytes * 100 / cycles : 0;
+    printf("  %s %d: %d.%d%d bytes/cycle\n", what, size,
+           (int)(x100 / 100), (int)(x100 / 10 % 10), (int)(x100 % 10));
+}
+
+static void membench(void){
+    static int sizes[] = {8, 64, 256, 1024, 4096};
+    char *a = mem_malloc(PGSIZE);
+    char *b = mem_malloc(PGSIZE + 8);
+    if(a == 0 || b == 0)
+        panic("membench");
+
+    printf("membench: %s\n", has_rvv ? "vector" : "scalar");
+    for(int i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++){
+        int size = sizes[i];
+        int rounds = (64 * PGSIZE) / size;
+        uint64_t bytes = (uint64_t)rounds * size, t;
+
+        t = r_cycle();
+        for(int r = 0; r < rounds; r++)
+            memcpy(b, a, size);
+        report("memcpy", size, bytes, r_cycle() - t);
+
+        t = r_cycle();
+        for(int r = 0; r < rounds; r++)
+            memcpy(b + 1, a, size);
+        report("memcpy+1", size, bytes, r_cycle() - t);
+
+        t = r_cycle();
+        for(int r = 0; r < rounds; r++)
+            memmove(b + 8, b, size);
+        report("memmove", size, bytes, r_cycle() - t);
+
+        t = r_cycle();
+        for(int r = 0; r < rounds; r++)
+            memset(b, r, size);
+        report("memset", size, bytes, r_cycle() - t);
+    }
+    mem_free(a);
+    mem_free(b);
+}
+#endif
+
 int main(){
 
     // now in supervisor mode
@@ -75,6 +123,11 @@ int main(){
         keyboard_init();
         
         binit(); // buffer cache
+        pcache_init(); // page cache
+        dcache_init(); // directory name cache
+#ifdef MEMBENCH
+        membench();
+#endif
         started = 1;
         __sync_synchronize();
         kvm_inithart();
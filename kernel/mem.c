@@ -3,6 +3,7 @@
 #include "defs.h"
 #include "platform.h"
 #include "lock.h"
+#include "param.h"
 #define ALIGNMENT 8
 
 typedef void *Blockptr_t;
@@ -57,13 +58,15 @@ static inline char _log2(size_t size)
 static unsigned int PAGEPOS;
 
 Blockptr_t sizehead[32] = {NULL}; // from 8 to PGSIZE/2 once init, last forever indentified by pos
-Blockptr_t pagehead = NULL;       // list of unused page, would be NULL
 // Blockptr_t spanhead = NULL;
 
 typedef struct _node
 {
     void *start;
     unsigned int usedORbitpos_bigORlen;
+    unsigned char order;  // order of the free block headed by this page
+    unsigned char isfree; // 1 if this page heads a block in freearea[order]
+    int ref;              // user mappings of this page, see ref_cnt_inc
 
 } Page; // every page size is PGSIZE
 
@@ -73,14 +76,40 @@ struct
     size_t len;
 } Manager;
 
+// buddy allocator for whole pages.
+// a free block of 2^order pages is aligned to 2^order pages (counted
+// from PageArray[0]) and is linked into freearea[order] through
+// its first page, so allocation and free are O(MAXORDER).
+#define MAXORDER 12 // 2^12 pages, the largest mm_malloc request
+
+struct freeblock
+{
+    struct freeblock *next;
+    struct freeblock *prev;
+};
+
+static struct freeblock *freearea[MAXORDER + 1];
+static size_t nfree[MAXORDER + 1]; // number of free blocks of every order
+static size_t freepages;
+
 static void managererr(size_t index, void *bp)
 {
     printf("getinfobybp len:%d index:%d bp:%p\n", Manager.len, index, bp);
 }
 
+static inline size_t pageindex(void *bp)
+{
+    return (bp - Manager.PageArray[0].start) / PGSIZE;
+}
+
+static inline void *pageaddr(size_t index)
+{
+    return Manager.PageArray[0].start + index * PGSIZE;
+}
+
 static Page getinfobybp(void *bp)
 { // get block information by bp
-    size_t index = (bp - Manager.PageArray[0].start) / PGSIZE;
+    size_t index = pageindex(bp);
     if (index > Manager.len)
     {
         managererr(index, bp);
@@ -89,20 +118,15 @@ static Page getinfobybp(void *bp)
     return Manager.PageArray[index];
 }
 
-static void setinfobybp(void *bp, Page info)
+static void setinfobybp(void *bp, unsigned int usedORbitpos_bigORlen)
 {
-    size_t index = (bp - Manager.PageArray[0].start) / PGSIZE;
+    size_t index = pageindex(bp);
     if (index > Manager.len)
     {
         managererr(index, bp);
     }
 
-    Manager.PageArray[index] = info;
-}
-
-static inline int istop(void *bp)
-{ // return 1 if the page of bp is one the top of heap
-    return ((bp - Manager.PageArray[0].start) / PGSIZE == Manager.len - 1);
+    Manager.PageArray[index].usedORbitpos_bigORlen = usedORbitpos_bigORlen;
 }
 
 // static void check(int pos)
@@ -115,41 +139,103 @@ static inline int istop(void *bp)
 //     printf("\n");
 // }
 
-// static void checklist(){
-//     Blockptr_t p = pagehead;
-//     for(;p;p=NEXT(p)){
-//         printf("->%p", p);
-//     }
-// }
+static void freearea_push(size_t index, int order)
+{
+    struct freeblock *b = pageaddr(index);
+    b->prev = NULL;
+    b->next = freearea[order];
+    if (b->next)
+        b->next->prev = b;
+    freearea[order] = b;
+    Manager.PageArray[index].order = order;
+    Manager.PageArray[index].isfree = 1;
+    nfree[order]++;
+}
 
-static void *allocpage(unsigned int usedORbitpos_bigORlen)
-{ // use sbrk and register this page
+static void freearea_remove(size_t index, int order)
+{
+    struct freeblock *b = pageaddr(index);
+    if (b->prev)
+        b->prev->next = b->next;
+    else
+        freearea[order] = b->next;
+    if (b->next)
+        b->next->prev = b->prev;
+    b->next = b->prev = NULL;
+    Manager.PageArray[index].isfree = 0;
+    nfree[order]--;
+}
 
-    void *p = mem_sbrk(PGSIZE);
-    if(p==NULL){
-      return NULL;
+// take the smallest free block of at least 2^order pages,
+// split it down and return the index of its first page, or -1
+static long buddy_alloc(int order)
+{
+    int k = order;
+    while (k <= MAXORDER && freearea[k] == NULL)
+    {
+        k++;
     }
-    Manager.PageArray[Manager.len++] = (Page){.start = p, .usedORbitpos_bigORlen = usedORbitpos_bigORlen};
-
-    return p;
+    if (k > MAXORDER)
+        return -1;
+
+    size_t index = pageindex(freearea[k]);
+    freearea_remove(index, k);
+    while (k > order)
+    { // give back the upper half
+        k--;
+        freearea_push(index + (1 << k), k);
+    }
+    freepages -= 1 << order;
+    return index;
 }
 
-static void *getpage(unsigned int usedORbitpos_bigORlen)
-{ // get one page from page list for use
-
-    if (pagehead == NULL)
+// free the aligned block of 2^order pages at index,
+// merging it with its buddy as long as the buddy is free too
+static void buddy_free(size_t index, int order)
+{
+    freepages += 1 << order;
+    while (order < MAXORDER)
     {
+        size_t buddy = index ^ (1 << order);
+        if (buddy + (1 << order) > Manager.len)
+            break;
+        Page *b = &Manager.PageArray[buddy];
+        if (!b->isfree || b->order != order)
+            break;
+        freearea_remove(buddy, order);
+        index &= ~(size_t)(1 << order);
+        order++;
+    }
+    freearea_push(index, order);
+}
 
-        return allocpage(usedORbitpos_bigORlen);
+// free any run of pages by cutting it into aligned blocks
+static void buddy_free_range(size_t index, size_t pages)
+{
+    while (pages > 0)
+    {
+        int order = 0;
+        while (order < MAXORDER && (index & (1 << order)) == 0 && (2 << order) <= pages)
+        {
+            order++;
+        }
+        buddy_free(index, order);
+        index += 1 << order;
+        pages -= 1 << order;
     }
-    else
+}
+
+static void *getpage(unsigned int usedORbitpos_bigORlen)
+{ // get one page from the buddy allocator for use
+
+    long index = buddy_alloc(0);
+    if (index < 0)
     {
-        void *pret = pagehead;
-        setinfobybp(pret, (Page){.start = pret, .usedORbitpos_bigORlen = usedORbitpos_bigORlen});
-        pagehead = NEXT(pret);
-        return pret; // return the second page of list
+        return NULL;
     }
-    return NULL;
+    void *pret = pageaddr(index);
+    setinfobybp(pret, usedORbitpos_bigORlen);
+    return pret;
 }
 
 static void *acquireonepage(int pos)
@@ -158,6 +244,10 @@ static void *acquireonepage(int pos)
     unsigned int usedORbitpos_bigORlen = 1 | (1 << pos);
 
     Blockptr_t *p = getpage(usedORbitpos_bigORlen); // get one page for use
+    if (p == NULL)
+    {
+        return NULL;
+    }
     if (pos < PAGEPOS)
     { // need to do sth.
         for (int i = 0; i < PGSIZE / (1 << pos) - 1; i++)
@@ -175,10 +265,18 @@ static int mm_init(void)
 
 
     PAGEPOS = _log2(PGSIZE);
-    Manager.len = 0;
-    Manager.PageArray = mem_sbrk(PGROUNDUP((heap_end-heap_top)/PGSIZE)*(sizeof(Page)));// can manage whole heap
-     
-    pagehead = NULL;
+    size_t pages = (heap_end - heap_top) / PGSIZE;
+    Manager.PageArray = mem_sbrk(PGROUNDUP(pages * sizeof(Page)));// can manage whole heap
+    heap_top = (void *)PGROUNDUP((uintptr_t)heap_top);
+
+    // every page left in the heap belongs to the buddy allocator
+    Manager.len = (heap_end - heap_top) / PGSIZE;
+    for (size_t i = 0; i < Manager.len; i++)
+    {
+        Manager.PageArray[i] = (Page){.start = heap_top + i * PGSIZE, .usedORbitpos_bigORlen = 0};
+    }
+    heap_top = heap_end;
+    buddy_free_range(0, Manager.len);
 
     for (int i = 3; i < PAGEPOS; i++)
     {
@@ -194,6 +292,10 @@ static void *smallfind(int pos)
     if (NEXT(sizehead[pos]) == NULL)
     { // only head
         Blockptr_t *p = acquireonepage(pos);
+        if (p == NULL)
+        {
+            return NULL;
+        }
         SETNEXT(sizehead[pos], p);
     }
 
@@ -210,109 +312,24 @@ static void *smallfind(int pos)
     return pret;
 }
 
-
-static void *adjustpages(int pages,void *pto){
-    for(int i=0;i<pages-1;i++){
-        SETNEXT(pto, pto+PGSIZE);
-        setinfobybp(pto, (Page){.start = pto,.usedORbitpos_bigORlen=0});
-        pto = pto+PGSIZE;
-    }
-    SETNEXT(pto, NULL);
-    setinfobybp(pto, (Page){.start = pto,.usedORbitpos_bigORlen=0});
-    return pto;
-}
-
 static void *bigfind(int pages)
 { // need how many pages
 
-    Blockptr_t ret = NULL, pret = NULL; // pret is the previou of ret
-    if (pagehead == NULL)
+    int order = _log2(pages);
+    long index = buddy_alloc(order);
+    if (index < 0)
     {
-        ret = allocpage(pages | (BIGBIT));
-        for (int i = 1; i < pages; i++)
-        {
-            allocpage(BIGBIT | 1); // used and big, in free , it is an error
-        }
+        return NULL;
     }
-    else
-    {
-        int count = 1;
-        Blockptr_t p = NEXT(pagehead), lp = pagehead, llp = NULL;
-        ret = lp;
-
-        while (p)
-        { // find continuous pages
-            if (lp + PGSIZE == p) // continuous
-            {
-                if (count == 1)
-                { // at the begining
-                    count++;
-                    pret = llp;
-                    ret = lp; // maybe is the begining of pages
-                }
-                else
-                {
-                    count++;
-                }
-                if (pages == count)
-                    break;
-            }
-            else
-            { // not continuous
-                ret = p;
-                pret = lp;
-                count = 1;
-            }
-            llp = lp;
-            lp = p;
-            p = NEXT(p);
-        }
+    // give back the pages above the request
+    buddy_free_range(index + pages, (1 << order) - pages);
 
-        if (count == pages)
-        { // there is more place or is just pages
-            if (ret == pagehead)
-            {
-                pagehead = NEXT(p); // p is NULL or other
-            }
-            else
-            {
-                SETNEXT(pret, NEXT(p)); // if ret != pagehead, then pret is not NULL
-            }
-        }
-        else // p==NULL
-        {
-            
-            if (istop(lp))
-            {
-                int last = pages - count;
-                
-                for (int i = 0; i < last; i++)
-                {
-                    allocpage(BIGBIT | 1);
-                }
-                
-                if (ret == pagehead)
-                {
-                    pagehead = NULL;
-                }
-                else
-                {
-                    SETNEXT(pret, NULL);
-                }
-            }else{
-                ret = allocpage(pages | (BIGBIT));
-                
-                for (int i = 0; i < pages; i++)
-                {
-                    allocpage(BIGBIT | 1); // used and big, in free , it is an error
-                }
-                if(pret != NULL)
-                SETNEXT(pret, NULL);
-            }
-        }
+    for (int i = 1; i < pages; i++)
+    {
+        Manager.PageArray[index + i].usedORbitpos_bigORlen = BIGBIT | 1; // used and big, in free , it is an error
     }
-    if(ret != NULL)setinfobybp(ret, (Page){.start=ret,.usedORbitpos_bigORlen = (BIGBIT)|(pages)}) ;
-    return ret;
+    Manager.PageArray[index].usedORbitpos_bigORlen = BIGBIT | pages;
+    return pageaddr(index);
 }
 
 /*
@@ -386,85 +403,86 @@ static void mm_free(void *bp)
         }
         else
         {
-            Blockptr_t p = pagehead;
-            Blockptr_t lp = NULL;
-            if (p == NULL)
-            {
-                pagehead = bp;
-                SETNEXT(pagehead, NULL);
-            }
-            else
-            {
-                if (p < bp)
-                {
-                    for (; p && bp > p; p = NEXT(p))
-                    { // 找到正确的位置，可能是中间，也可能是最后
-                        lp = p;
-                    }
-
-                    if (p && bp < p)
-                    {
-                        SETNEXT(lp, bp);
-                        SETNEXT(bp, p);
-                    }
-                    else if (!p)
-                    { // end of list
-                        SETNEXT(lp, bp);
-                        SETNEXT(bp, NULL);
-                    }
-                }
-                else
-                { // bp < p
-
-                    SETNEXT(bp, pagehead);
-                    pagehead = bp;
-                }
-            }
-            setinfobybp(bp, (Page){.start = bp, .usedORbitpos_bigORlen = 0});
+            setinfobybp(bp, 0);
+            buddy_free(pageindex(bp), 0);
         }
     }
     else
     {
         int pages = info.usedORbitpos_bigORlen & (~(BIGBIT));
-        void *pend = adjustpages(pages, bp); 
-        
-    
-        if (pagehead == NULL)
+        size_t index = pageindex(bp);
+        for (int i = 0; i < pages; i++)
         {
-            pagehead = bp;
-      
-            SETNEXT(pend,NULL);
-                        
+            Manager.PageArray[index + i].usedORbitpos_bigORlen = 0;
         }
-        else
-        {   
-            
-            if (pagehead < bp)
-            {
-                Blockptr_t p = pagehead;
-                Blockptr_t lp = NULL;
-                for (; p && bp > p; p = NEXT(p))
-                { // 找到正确的位置，可能是中间，也可能是最后
-                    lp = p;
-                }
-                // bp is between lp and p
-
-                SETNEXT(lp,bp);
-               
-                SETNEXT(pend,p);
-                               
-            }
-            else
-            { // bp < p
+        buddy_free_range(index, pages);
+    }
+}
 
-                SETNEXT(pend, pagehead);
-                pagehead = bp;
+// fragmentation report of the page allocator, for ^T
+void mem_dump(){
+    lock();
+    int largest = -1;
+    printf("mem: %d free pages of %d, free blocks by order:", (int)freepages, (int)Manager.len);
+    for (int i = 0; i <= MAXORDER; i++)
+    {
+        printf(" %d", (int)nfree[i]);
+        if (nfree[i])
+            largest = i;
+    }
+    printf("\n");
+    if (freepages)
+    {
+        // how much of the free memory can't be handed out as one block
+        int frag = 100 - (int)(((size_t)1 << largest) * 100 / freepages);
+        printf("mem: largest free block %d pages, fragmentation %d%%\n", 1 << largest, frag);
+    }
+    unlock();
+}
 
-            }
-        }
-        
+// per-cpu magazines in front of the global lists.
+// every size class up to a whole page has one magazine per cpu,
+// refilled from / drained to the global lists MAG_BATCH objects
+// at a time, so most mem_malloc/mem_free calls don't take lk.
+#define MAG_SIZE 32
+#define MAG_BATCH 16
+
+struct magazine
+{
+    int n;
+    void *objs[MAG_SIZE];
+};
+
+static struct magazine mags[NCPU][PGSHIFT + 1]; // indexed by pos
+
+// called with interrupts off
+static void mag_refill(struct magazine *m, int pos)
+{
+    lock();
+    while (m->n < MAG_BATCH)
+    {
+        void *p = mm_malloc(1 << pos);
+        if (p == NULL)
+            break;
+        m->objs[m->n++] = p;
     }
-    // checklist();
+    unlock();
+}
+
+// called with interrupts off, give back the oldest MAG_BATCH objects
+static void mag_drain(struct magazine *m)
+{
+    lock();
+    for (int i = 0; i < MAG_BATCH; i++)
+    {
+        mm_free(m->objs[i]);
+    }
+    unlock();
+    for (int i = MAG_BATCH; i < m->n; i++)
+    {
+        m->objs[i - MAG_BATCH] = m->objs[i];
+    }
+    m->n -= MAG_BATCH;
 }
 
 // mm (kernel memory management) module
@@ -480,15 +498,91 @@ void mem_init(){
 
 }
 
+static void* mem_alloc(size_t size){
+    int pos = _log2(size) > 3 ? _log2(size) : 3;
+    void *ret = NULL;
+
+    if (pos > PAGEPOS)
+    {
+        lock();
+        ret = mm_malloc(size);
+        unlock();
+        return ret;
+    }
+
+    push_off();
+    struct magazine *m = &mags[cpuid()][pos];
+    if (m->n == 0)
+        mag_refill(m, pos);
+    if (m->n > 0)
+        ret = m->objs[--m->n];
+    pop_off();
+    return ret;
+}
+
 void* mem_malloc(size_t size){
-    lock();
-    void *ret = mm_malloc(size);
-    unlock();
+    void *ret = mem_alloc(size);
+    // out of memory, let the disk block cache give some back
+    if (ret == NULL && bshrink((size + PGSIZE - 1) / PGSIZE + MAG_BATCH))
+    {
+        ret = mem_alloc(size);
+    }
     return ret;
 }
 
 void mem_free(void* ptr){
-    lock();
-    mm_free(ptr);
-    unlock();
-}
\ No newline at end of file
+    // the page info of an allocated block doesn't change
+    // until it is freed, so it can be read without lk
+    Page info = getinfobybp(ptr);
+
+    if (info.usedORbitpos_bigORlen & (BIGBIT))
+    {
+        lock();
+        mm_free(ptr);
+        unlock();
+        return;
+    }
+
+    int pos = _log2(info.usedORbitpos_bigORlen & ~1);
+    push_off();
+    struct magazine *m = &mags[cpuid()][pos];
+    if (m->n == MAG_SIZE)
+        mag_drain(m);
+    m->objs[m->n++] = ptr;
+    pop_off();
+}
+
+// reference counts of physical pages mapped into user space.
+// they live in PageArray, so fork and copy-on-write don't need
+// a lookup structure or a lock, only atomic updates.
+static Page *refpage(uint64_t pa)
+{
+    size_t index = pageindex((void *)pa);
+    if ((pa & (PGSIZE - 1)) || index >= Manager.len)
+    {
+        managererr(index, (void *)pa);
+        panic("ref_cnt: bad pa");
+    }
+    return &Manager.PageArray[index];
+}
+
+void ref_cnt_inc(uint64_t pa){
+    __sync_fetch_and_add(&refpage(pa)->ref, 1);
+}
+
+// drop one reference, the page is freed with the last one
+void ref_cnt_dec(uint64_t pa){
+    int ref = __sync_sub_and_fetch(&refpage(pa)->ref, 1);
+    if (ref == 0)
+    {
+        mem_free((void *)pa);
+    }
+    else if (ref < 0)
+    {
+        panic("ref_cnt_dec");
+    }
+}
+
+int ref_cnt_get(uint64_t pa){
+    return __atomic_load_n(&refpage(pa)->ref, __ATOMIC_SEQ_CST);
+}
@@ -4,122 +4,82 @@
 #include "types.h"
 #include "rbtree.h"
 #include "mmap.h"
-
-static struct rb_tree ref;
-
-static lm_lock_t ref_lock;
+#include "file.h"
 
 static int compf(const struct rb_node *l, const struct rb_node *r, void *){
     return ((MmapNode_t*)l->data)->addr < ((MmapNode_t*)r->data)->addr;
 }
 
-static int ref_cnt_compf(const struct rb_node *l, const struct rb_node *r, void *){
-    return ((RefCntNode_t*)l->data)->ref_cnt < ((RefCntNode_t*)r->data)->ref_cnt ;
-}
-
-static struct rb_node *ref_cnt_alloc(uint64_t pa, uint64_t ref_cnt){
-    struct rb_node *node = (struct rb_node*)mem_malloc(sizeof(struct rb_node));
-    RefCntNode_t *data = (RefCntNode_t*)mem_malloc(sizeof(RefCntNode_t));
-    *data = (RefCntNode_t){pa, ref_cnt};
-    node->data = data;
-    node->type = RefCntNode;
-    return node;
-}
-
-static int ref_cnt_inc(uint64_t pa){
-    int locked = check_lock(&ref_lock);
-    struct rb_node cmp_node;
-    RefCntNode_t cmp_data;
-    cmp_data.addr = pa;
-    cmp_node.data = (void*)&cmp_data;
-    struct rb_node *node = rb_find(&ref, &cmp_node);
-    if(node == rb_head(&ref)){
-        node = ref_cnt_alloc(pa, 1);
-        rb_insert(&ref, node, 0);
-    }
-    else{
-        ((RefCntNode_t*)node->data)->ref_cnt++;
-    }
-    if(locked)
-        lm_unlock(&ref_lock);
-    return 0;
-}
-
-static int ref_cnt_dec(uint64_t pa){
-    int locked = check_lock(&ref_lock);
-    struct rb_node cmp_node;
-    RefCntNode_t cmp_data;
-    cmp_data.addr = pa;
-    cmp_node.data = (void*)&cmp_data;
-    struct rb_node *node = rb_find(&ref, &cmp_node);
-    if(node == rb_head(&ref)){
-        if(locked)
-            lm_unlock(&ref_lock);
-        return -1;
-    }
-    else{
-        ((RefCntNode_t*)node->data)->ref_cnt--;
-        if(((RefCntNode_t*)node->data)->ref_cnt == 0){
-            rb_erase(&ref, node);
-            mem_free((void*)((RefCntNode_t*)node->data)->addr);
-            mem_free(node->data);
-            mem_free(node);
-        }
-    }
-    if(locked)
-        lm_unlock(&ref_lock);
-    return 0;
-
-}
-
-static uint64_t ref_cnt_get(uint64_t pa){
-    int locked = check_lock(&ref_lock);
-    struct rb_node cmp_node;
-    RefCntNode_t cmp_data;
-    cmp_data.addr = pa;
-    cmp_node.data = (void*)&cmp_data;
-    struct rb_node *node = rb_find(&ref, &cmp_node);
-    if(node == rb_head(&ref)){
-        if(locked)
-            lm_unlock(&ref_lock);
-        return 0;
-    }
-    if(locked)
-        lm_unlock(&ref_lock);
-    return ((RefCntNode_t*)node->data)->ref_cnt;
-}
-
 static void mmap_dump(struct rb_node *node){
     MmapNode_t *data = (MmapNode_t*)node->data;
     printf("addr: %p, sz: %p, perm: %p, flag: %p\n", data->addr, data->sz, data->perm, data->flag);
-    for(uint64_t i = data->addr; i < data->addr + data->sz; i+=PGSIZE){
-        printf("addr: %p ref_cnt: %d\n",i, (int)ref_cnt_get(i));
-    }
 }
 
 void mmap_init(){
-    // create a global rbtree for the reference count of the physical page
-    rb_init(&ref, 0, ref_cnt_compf, 0);
-    lm_lockinit(&ref_lock, "ref_lock");
+    // the reference counts of physical pages are kept by mem.c
 }
 
 void mmap_free(struct rb_node *node){
     mmap_dump(node);
     if(node->type == MmapNode){
+        MmapNode_t *data = (MmapNode_t*)node->data;
+        if(data->ip){
+            begin_op();
+            iput(data->ip);
+            end_op();
+        }
         mem_free(node->data);
         mem_free(node);
     }
     
 }
 
-static void mmap_freef(struct rb_node *n){
+// a shared writable file mapping writes its pages back to the file
+static int mmap_writable_file(MmapNode_t *data){
+    return (data->flag & MAP_FILE) && (data->flag & MAP_SHARED) && (data->perm & PERM_W);
+}
+
+// write the file-backed part of page va back through the inode.
+// must hold data->ip->lock
+static void mmap_writeback(MmapNode_t *data, uint64_t va, uint64_t pa){
+    uint64_t in = va - data->addr;
+    if(in >= data->filesz)
+        return;
+    uint64_t off = data->off + in;
+    // never grow the file, it may have been truncated since
+    if(off >= data->ip->size)
+        return;
+    uint64_t n = data->filesz - in < PGSIZE ? data->filesz - in : PGSIZE;
+    if(n > data->ip->size - off)
+        n = data->ip->size - off;
+    writei(data->ip, 0, pa, off, n);
+}
 
-    MmapNode_t *data = (MmapNode_t*)n->data;
-    for(uint64_t i = data->addr; i < data->addr + data->sz; i+=PGSIZE){
-        // decrease the reference count of the physical page
-        ref_cnt_dec(i);
+// unmap every page of the region and drop its reference,
+// writing shared file pages back first if they were written to
+static void mmap_unref(pagetable_t pagetable, MmapNode_t *data){
+    int writeback = mmap_writable_file(data);
+    if(writeback){
+        begin_op();
+        ilock(data->ip);
+    }
+    for(uint64_t va = data->addr; va < data->addr + data->sz; va+=PGSIZE){
+        pte_t *pte = walk(pagetable, va, 0);
+        if(pte == 0 || (*pte & PTE_V) == 0){
+            // the page is not mapped
+            continue;
+        }
+        uint64_t pa = PTE2PA(*pte);
+        int dirty = (*pte & PTE_D) != 0;
+        *pte = 0;
+        if(writeback && dirty)
+            mmap_writeback(data, va, pa);
+        ref_cnt_dec(pa);
+    }
+    if(writeback){
+        iunlock(data->ip);
+        end_op();
     }
-    mmap_free(n);
 }
 
 Mmap_t *mmap_create(task_t *t){
@@ -129,10 +89,16 @@ Mmap_t *mmap_create(task_t *t){
 }
 
 
-void mmap_destroy(Mmap_t *obj){
+// must be called before the pagetable is freed
+void mmap_destroy(Mmap_t *obj, pagetable_t pagetable){
     if(obj == 0)
         return;
-    rb_clear_free(&obj->tree, mmap_freef);
+    if(pagetable){
+        struct rb_node *head = rb_head(&obj->tree);
+        for(struct rb_node *node = rb_lmst(&obj->tree); node != head; node = rb_next(node))
+            mmap_unref(pagetable, (MmapNode_t*)node->data);
+    }
+    rb_clear_free(&obj->tree, mmap_free);
     mem_free(obj);
 }
 
@@ -142,19 +108,27 @@ struct rb_node *mmap_alloc(uint64_t addr,
         uint64_t flag){
     MmapNode_t* data = (MmapNode_t*)mem_malloc(sizeof(MmapNode_t));
     struct rb_node *node = (struct rb_node*)mem_malloc(sizeof(struct rb_node));
-    *data = (MmapNode_t){addr, sz, perm, flag};
+    *data = (MmapNode_t){addr, sz, perm, flag, 0, 0, 0};
     node->data = data;
     node->type = MmapNode;
     return node;
 }
 
 struct rb_node *mmap_alloc_copy(MmapNode_t *data){
-    return mmap_alloc(data->addr, data->sz, data->perm, data->flag);
+    struct rb_node *node = mmap_alloc(data->addr, data->sz, data->perm, data->flag);
+    MmapNode_t *copy = (MmapNode_t*)node->data;
+    if(data->ip)
+        copy->ip = idup(data->ip);
+    copy->off = data->off;
+    copy->filesz = data->filesz;
+    return node;
 }
 
 // map an anonymous memory region with given permission and size
 // round up the size to PGSIZE
 // if addr is 0, the kernel will choose a random virtual address
+// with MAP_FILE, map the open file fd from offset instead,
+// MAP_SHARED mappings write their pages back to the file
 int sys_mmap(){
 
   task_t *t = mytask();
@@ -162,9 +136,31 @@ int sys_mmap(){
   uint64_t sz = t->trapframe->a1;
   uint64_t perm = t->trapframe->a2;
   uint64_t flag = t->trapframe->a3;
+  int fd = t->trapframe->a4;
+  uint64_t offset = t->trapframe->a5;
    
-  uint64_t ret = mmap(t,addr, sz, perm, flag,0 );
-  printf("ret: %p", ret);
+  uint64_t ret;
+  if(flag & MAP_FILE){
+    file_t *f;
+    if(fd < 0 || fd >= NOFILE || (f = t->ofile[fd]) == 0 || f->type != FD_INODE || !f->readable){
+      t->trapframe->a0 = -1;
+      return -1;
+    }
+    if((flag & MAP_SHARED) && (perm & PERM_W) && !f->writable){
+      t->trapframe->a0 = -1;
+      return -1;
+    }
+    ilock(f->ip);
+    uint64_t filesz = 0;
+    if(offset < f->ip->size)
+      filesz = f->ip->size - offset;
+    if(filesz > PGROUNDUP(sz))
+      filesz = PGROUNDUP(sz);
+    iunlock(f->ip);
+    ret = mmap_file(t->mmap_obj, t->pagetable, addr, sz, perm, flag, f->ip, offset, filesz);
+  }else{
+    ret = mmap(t,addr, sz, perm, flag,0 );
+  }
   t->trapframe->a0 = ret;
   return 0;
 }
@@ -183,6 +179,7 @@ int uvm_mappages(pagetable_t pagetable, uint64_t va, uint64_t sz, int perm){
         uint64_t pa = (uint64_t)mem_malloc(PGSIZE);
         if(pa == 0)
             return -1;
+        memset((void*)pa, 0, PGSIZE);
         if(uvm_map(pagetable, a,pa, PGSIZE, perm, 0) < 0)
             return -1;
         ref_cnt_inc(pa);
@@ -212,7 +209,7 @@ uint64_t mmap_by_obj(Mmap_t *obj, pagetable_t pagetable, uint64_t addr, uint64_t
     sz = PGROUNDUP(sz);
 
     // using random anonymous memory
-    int rand_memory = (addr == 0 && ((flag & MAP_ZERO )== 0) && (flag & MAP_ANONYMOUS));
+    int rand_memory = (addr == 0 && ((flag & MAP_ZERO )== 0) && (flag & (MAP_ANONYMOUS|MAP_FILE)));
     if(rand_memory){
         addr = VA_ANYNOMOUS+obj->high_level;
     }
@@ -254,100 +251,154 @@ MmapNode_t *mmap_find(Mmap_t *obj, uint64_t addr){
     return (MmapNode_t*)node->data;
 }
 
+// map filesz bytes of ip from offset off at addr, the rest of sz reads as zero.
+// nothing is read until the pages are touched.
+// the mapping takes its own reference of ip.
+uint64_t mmap_file(Mmap_t *obj, pagetable_t pagetable, uint64_t addr, uint64_t sz, uint64_t perm, uint64_t flag,
+        inode_t *ip, uint64_t off, uint64_t filesz){
+    if(off % PGSIZE != 0 || filesz > PGROUNDUP(sz))
+        return -1;
+    addr = mmap_by_obj(obj, pagetable, addr, sz, perm, flag | MAP_FILE, 0);
+    MmapNode_t *mmap_node = mmap_find(obj, addr);
+    mmap_node->ip = idup(ip);
+    mmap_node->off = off;
+    mmap_node->filesz = filesz;
+    return addr;
+}
+
 void handle_accessfault(){
     panic("access fault");
 }
 
 
-// handle the page fault
-void handle_pagefault(){
-
-    // stval will contain the faulting address
-    uint64_t stval = r_stval();
-    uint64_t scause = r_scause();
-    uint64_t va = PGROUNDDOWN(stval);
-    task_t *t = mytask();
-    Mmap_t *obj = t->mmap_obj;
+// fault in page va of a file mapping, return it with one reference.
+// read-only pages wholly inside the file share the page cache,
+// others get a private copy with the part past filesz zeroed.
+static uint64_t mmap_file_page(MmapNode_t *mmap_node, uint64_t va){
+    uint64_t in = va - mmap_node->addr; // offset in the mapping
+    uint64_t n = 0;
+    uint64_t cpa = 0;
+
+    if(in < mmap_node->filesz){
+        ilock(mmap_node->ip);
+        cpa = pcache_get(mmap_node->ip, (mmap_node->off + in) / PGSIZE);
+        iunlock(mmap_node->ip);
+        if(cpa == 0)
+            return 0;
+        // shared mappings always use the cached page,
+        // so writes are seen by everyone mapping the file
+        if(mmap_node->flag & MAP_SHARED)
+            return cpa;
+        if((mmap_node->perm & PERM_W) == 0 && in + PGSIZE <= mmap_node->filesz)
+            return cpa;
+        n = mmap_node->filesz - in < PGSIZE ? mmap_node->filesz - in : PGSIZE;
+    }
 
-    MmapNode_t *mmap_node = mmap_find(obj, va);
-    if(mmap_node == 0){
-        panic("page fault can't find the mapping");
+    uint64_t pa = (uint64_t)mem_malloc(PGSIZE);
+    if(pa != 0){
+        memcpy((void*)pa, (void*)cpa, n);
+        memset((void*)(pa + n), 0, PGSIZE - n);
+        ref_cnt_inc(pa);
     }
-    if(!(mmap_node->addr <= va && va < mmap_node->addr + mmap_node->sz)){
-        panic("page fault can't find the mapping");
+    if(cpa)
+        ref_cnt_dec(cpa);
+    return pa;
+}
+
+// make page va of task t accessible for access_perm:
+// allocate it, read it from its file, or copy it on write.
+// return 0 on success, -1 if the mapping doesn't allow the access.
+int mmap_fault(task_t *t, uint64_t va, uint64_t access_perm){
+    va = PGROUNDDOWN(va);
+    MmapNode_t *mmap_node = mmap_find(t->mmap_obj, va);
+    if(mmap_node == 0)
+        return -1;
+    if(!(mmap_node->addr <= va && va < mmap_node->addr + mmap_node->sz))
+        return -1;
+    if((mmap_node->perm & access_perm) == 0){
+        // the proc doesn't have the permission to access the page
+        return -1;
     }
 
-    // found the mapping
     // check whether the page is already mapped
     pte_t *pte = walk(t->pagetable, va, 0);
     if(pte != 0 && (*pte & PTE_V) != 0){
         // the page is already exist
-        // check the permission
-        uint64_t access_perm = 0;
-        switch (scause)
-        {
-        case 12:
-            access_perm = PERM_X;
-            break;
-        case 13:
-            access_perm = PERM_R;
-            break;
-        case 15:
-            access_perm = PERM_W;
-            break;
-        default:
-            break;
-        }
-        
-        if((mmap_node->perm & access_perm) == 0){
-            // the proc doesn't have the permission to access the page
-            panic("access fault permission denied");
-        }
         uint64_t flags=  PTE_FLAGS(*pte);
-        printf("page fault: va: %p, pa: %p, perm: %p\n", va, PTE2PA(*pte), flags);
         if(((flags & PTE_W) == 0) && access_perm == PERM_W){
             // copy on write
             // allocate physical memory
-            lm_lock(&ref_lock);
-            if(ref_cnt_get(va)==1){
+            uint64_t old = PTE2PA(*pte);
+            if(ref_cnt_get(old)==1){
                 // the physical page is only referenced by the current task
                 // we can modify the page directly
                 *pte |= PTE_W;
             }else{
-                ref_cnt_dec(PTE2PA(*pte));
                 uint64_t pa = (uint64_t)mem_malloc(PGSIZE);
                 if(pa == 0){
                     panic("access fault can't allocate physical memory");
                 }
                 // copy the content of the father's page
-                memcpy((void*)pa, (void*)PTE2PA(*pte), PGSIZE);
+                memcpy((void*)pa, (void*)old, PGSIZE);
                 // map the physical memory to the virtual address
                 
                 *pte = PA2PTE(pa) | flags| PTE_W;
                 ref_cnt_inc(pa);
+                // drop the shared page only after copying it
+                ref_cnt_dec(old);
             }
-            lm_unlock(&ref_lock);
         }
+        return 0;
+    }
 
+    // the page is not mapped
+    // allocate physical memory
+    uint64_t pa;
+    if(mmap_node->flag & MAP_FILE){
+        pa = mmap_file_page(mmap_node, va);
     }else{
-        // the page is not mapped
-        // allocate physical memory
-        if(mmap_node->flag & MAP_ANONYMOUS){
-            // anonymous memory
-            uint64_t pa = (uint64_t)mem_malloc(PGSIZE);
-            if(pa == 0){
-                panic("page fault can't allocate physical memory");
-            }
-            // map the physical memory to the virtual address
-            if(uvm_map(t->pagetable, va, pa, PGSIZE, mmap_node->perm, 0) < 0){
-                panic("page fault can't map physical memory");
-            }
+        // anonymous memory
+        pa = (uint64_t)mem_malloc(PGSIZE);
+        if(pa != 0){
+            memset((void*)pa, 0, PGSIZE);
             ref_cnt_inc(pa);
         }
     }
+    if(pa == 0){
+        panic("page fault can't allocate physical memory");
+    }
+    // map the physical memory to the virtual address
+    if(uvm_map(t->pagetable, va, pa, PGSIZE, mmap_node->perm, 0) < 0){
+        panic("page fault can't map physical memory");
+    }
+    return 0;
+}
 
-    
+// handle the page fault
+void handle_pagefault(){
 
+    // stval will contain the faulting address
+    uint64_t stval = r_stval();
+    uint64_t scause = r_scause();
+    uint64_t access_perm = 0;
+    switch (scause)
+    {
+    case 12:
+        access_perm = PERM_X;
+        break;
+    case 13:
+        access_perm = PERM_R;
+        break;
+    case 15:
+        access_perm = PERM_W;
+        break;
+    default:
+        break;
+    }
+
+    if(mmap_fault(mytask(), stval, access_perm) < 0){
+        panic("page fault can't find the mapping");
+    }
 }
 
 void copy_mmap(task_t *t, task_t *nt){
@@ -365,34 +416,37 @@ void copy_mmap(task_t *t, task_t *nt){
         
         // do some page table copy
         MmapNode_t *mmap_node = (MmapNode_t*)n->data;
-
-        for(uint64_t va=mmap_node->addr; va<mmap_node->addr+mmap_node->sz; va+=PGSIZE){
-            // don't need to allocate physical memory
-            pte_t *pte = walk(t->pagetable, va, 0);
-            if(pte == 0 || (*pte & PTE_V) == 0){
+        uint64_t end = mmap_node->addr + mmap_node->sz;
+
+        // one leaf table at a time, the pages themselves are
+        // only copied when the first write faults on them
+        for(uint64_t va=mmap_node->addr; va<end; ){
+            uint64_t next = (va + LEAFSIZE) & ~(LEAFSIZE - 1);
+            if(next > end)
+                next = end;
+            pagetable_t from = walk_leaf(t->pagetable, va, 0);
+            if(from == 0){
                 // we havn't allocated the page table yet
                 // just skip
+                va = next;
                 continue;
             }
-            // map the same physical memory to the new task
-            // for the use of copy-on-write
-            // disable the write permission
-            uint64_t mask = 0xffffffffffffffff;
-            // when map private, disable the write permission
-            // the page is copy-on-write
-            if(mmap_node->flag & MAP_PRIVATE){
-                mask &= ~PTE_W;
+            pagetable_t to = 0;
+            for(int i = PX(0, va); va < next; i++, va += PGSIZE){
+                pte_t pte = from[i];
+                if((pte & PTE_V) == 0)
+                    continue;
+                // when map private, disable the write permission
+                // of both tasks, the page is copy-on-write
+                if(mmap_node->flag & MAP_PRIVATE){
+                    pte &= ~PTE_W;
+                    from[i] = pte;
+                }
+                if(to == 0 && (to = walk_leaf(nt->pagetable, va, 1)) == 0)
+                    panic("copy_mmap: walk_leaf");
+                to[i] = pte;
+                ref_cnt_inc(PTE2PA(pte));
             }
-
-            uint64_t pa = PTE2PA(*pte);
-            // remap the father's memory
-            if(uvm_map(t->pagetable, va, pa, PGSIZE, mmap_node->perm & mask, 1) < 0)
-                panic("copy_mmap: uvm_map");
-
-            if(uvm_map(nt->pagetable, va, pa, PGSIZE, mmap_node->perm & mask, 0) < 0)
-                panic("copy_mmap: uvm_map");
-
-            ref_cnt_inc(pa);
         }
 
         node = rb_next(node);
@@ -418,19 +472,7 @@ int munmap(uint64_t addr){
     }
     MmapNode_t *mmap_node = (MmapNode_t*)node->data;
     // unmap the memory region
-    // start a transaction
-    lm_lock(&ref_lock);
-    for(uint64_t va = mmap_node->addr; va < mmap_node->addr + mmap_node->sz; va+=PGSIZE){
-        pte_t *pte = walk(t->pagetable, va, 0);
-        if(pte == 0 || (*pte & PTE_V) == 0){
-            // the page is not mapped
-            continue;
-        }
-        uint64_t pa = PTE2PA(*pte);
-        vm_unmap(t->pagetable, va, 1, 0);
-        ref_cnt_dec(pa);
-    }
-    lm_unlock(&ref_lock);
+    mmap_unref(t->pagetable, mmap_node);
 
     // free the node
     rb_erase(&obj->tree, node);
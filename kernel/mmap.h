@@ -10,5 +10,6 @@
 #define MAP_PRIVATE (2)
 #define MAP_SHARED (4)
 #define MAP_ZERO (8)
+#define MAP_FILE (16)
 
 
@@ -11,6 +11,7 @@
 #include "proc.h"
 #include "file.h"
 #include "monitor.h"
+#include "mmap.h"
 
 extern device_t devsw[];
 
@@ -33,28 +34,62 @@ uint64_t get_monitor_info(device_t*dev,  int user_dst, uint64_t dst, uint64_t n)
 }
 
 
+// push the framebuffer to the screen
+static void
+monitor_present(monitor_t *this){
+    virtio_gpu_transfer_to_host_2d();
+    virtio_gpu_resource_flush();
+}
+
+// map the framebuffer into the calling task, so it draws in place
+// and presents without write() copying every frame.
+// the framebuffer holds a reference to each of its pages, so
+// unmapping them never frees them.
+// once mapped, write() is refused: a task drawing in place could
+// tear the frame write() copies in, and mappings are not tracked
+// past munmap, so this holds for the rest of the boot.
+static uint64_t
+monitor_map(monitor_t *this){
+    task_t *t = mytask();
+    uint64_t addr = mmap(t, 0, this->buf_len, PERM_R | PERM_W, MAP_SHARED | MAP_ANONYMOUS, 0);
+    if(addr == (uint64_t)-1)
+        return -1;
+    lm_lock(&this->lock);
+    this->mapped = 1;
+    lm_unlock(&this->lock);
+    for(uint64_t off = 0; off < this->buf_len; off += PGSIZE){
+        uint64_t pa = (uint64_t)this->buf + off;
+        if(uvm_map(t->pagetable, addr + off, pa, PGSIZE, PERM_R | PERM_W, 0) < 0){
+            munmap(addr);
+            return -1;
+        }
+        ref_cnt_inc(pa);
+    }
+    return addr;
+}
+
 uint64_t
 monitor_write(device_t*dev, int user_src, uint64_t src, uint64_t n){
     // write to monitor
 
-    lm_lock(&monitor0.lock);
-
     monitor_t *this = (monitor_t*)dev->ptr;
 
     if(n < this->buf_len){
         return -1;
     }
 
+    lm_lock(&this->lock);
+    if(this->mapped){
+        lm_unlock(&this->lock);
+        return -1;
+    }
     if(either_copyin(this->buf, user_src, src, this->buf_len) == -1){
+        lm_unlock(&this->lock);
         return -1;
     }
+    lm_unlock(&this->lock);
 
-    lm_unlock(&monitor0.lock);
-
-
-    virtio_gpu_transfer_to_host_2d();
-    virtio_gpu_resource_flush();
-
+    monitor_present(this);
 
     return this->buf_len;
 }
@@ -73,7 +108,12 @@ monitor_ioctl(device_t*dev, int user_src, uint64_t cmd, uint64_t arg){
     case MONITOR_GET_INFO:
         return get_monitor_info(dev, user_src, arg, sizeof(struct monitor_info));
         break;
-    
+    case MONITOR_MAP:
+        return monitor_map((monitor_t*)dev->ptr);
+    case MONITOR_PRESENT:
+        monitor_present((monitor_t*)dev->ptr);
+        return 0;
+
     default:
         break;
     }
@@ -96,6 +136,10 @@ monitor_init(void){
     lm_lockinit(&monitor0.lock, "monitor0");
 
     virtio_gpu_init(&monitor0);
+
+    // the framebuffer's own reference, see monitor_map
+    for(uint64_t off = 0; off < monitor0.buf_len; off += PGSIZE)
+        ref_cnt_inc((uint64_t)monitor0.buf + off);
     
 
 }
\ No newline at end of file
@@ -12,8 +12,11 @@ typedef struct monitor{
     void* buf;
     size_t buf_len;
     int width, height;
+    int mapped;      // set once the framebuffer is mapped, see monitor_write
 } monitor_t;
 
 enum {
-    MONITOR_GET_INFO = 1
+    MONITOR_GET_INFO = 1,
+    MONITOR_MAP = 2,     // map the framebuffer, returns its address
+    MONITOR_PRESENT = 3  // show the mapped framebuffer
 };
\ No newline at end of file
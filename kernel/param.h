@@ -3,9 +3,19 @@
 #define DEV_MAX 16 // maximum number of devices
 
 #define NOFILE 100 // open files per system
-#define NBUF 100 // size of disk block cache
+#define NBUF 100 // initial size of disk block cache
+#define BCACHE_FRAC 8 // the disk block cache may use up to 1/BCACHE_FRAC of RAM
+#define NPCACHE 256 // max pages kept by the page cache
+#define NDCACHE 128 // directory name cache entries
+#define MAXBRUN 16 // max blocks in one disk request
+#define RA_MIN 4 // initial readahead window, in blocks
+#define RA_MAX 32 // max readahead window, in blocks
+#define FLUSH_INTERVAL 30 // ticks a dirty block may wait for write-back
+#define RESV_BLOCKS 64 // free blocks reserved ahead of a growing file
+#define MAXOPBLOCKS 40 // max # of blocks any FS op writes, a truncate may touch every bitmap block
+#define LOGSIZE (MAXOPBLOCKS*4) // max data blocks in on-disk log
 #define ROOTDEV       1  // device number of file system root disk
-#define NINODE 100 // maximum number of active i-nodes
+#define NINODE 100 // in-memory i-nodes kept before unreferenced ones are recycled
 #define ROOTINO  1   // root i-number
 #define MAXARG       32  // max exec arguments
 #define MAXPATH      128 // max path name
@@ -0,0 +1,196 @@
+// page cache
+// file pages mapped into user space, keyed by (dev, inum, page number).
+// the cache holds one reference to every page it keeps, mappings
+// take their own, so an evicted page lives on until it is unmapped.
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "fs.h"
+#include "file.h"
+#include "lock.h"
+#include "memlayout.h"
+
+#define NPCBUCKET 61
+
+struct cpage {
+  uint_t dev;
+  uint_t inum;
+  uint_t pgno;
+  uint64_t pa;
+  struct cpage *hnext; // hash chain
+  struct cpage *prev;  // LRU list
+  struct cpage *next;
+};
+
+struct {
+  lm_lock_t lock;
+  struct cpage *bucket[NPCBUCKET];
+
+  // head.next is most recent, head.prev is least.
+  struct cpage head;
+  int n;
+} pcache;
+
+static uint_t
+pchash(uint_t dev, uint_t inum, uint_t pgno)
+{
+  return (dev * 31 + inum * 1009 + pgno) % NPCBUCKET;
+}
+
+void
+pcache_init(void)
+{
+  lm_lockinit(&pcache.lock, "pcache");
+  pcache.head.prev = &pcache.head;
+  pcache.head.next = &pcache.head;
+}
+
+static void
+lru_unlink(struct cpage *p)
+{
+  p->next->prev = p->prev;
+  p->prev->next = p->next;
+}
+
+static void
+lru_push(struct cpage *p)
+{
+  p->next = pcache.head.next;
+  p->prev = &pcache.head;
+  pcache.head.next->prev = p;
+  pcache.head.next = p;
+}
+
+static void
+hash_unlink(struct cpage *p)
+{
+  struct cpage **pp = &pcache.bucket[pchash(p->dev, p->inum, p->pgno)];
+  while(*pp != p)
+    pp = &(*pp)->hnext;
+  *pp = p->hnext;
+}
+
+static struct cpage*
+pcache_lookup(uint_t dev, uint_t inum, uint_t pgno)
+{
+  struct cpage *p;
+
+  for(p = pcache.bucket[pchash(dev, inum, pgno)]; p; p = p->hnext){
+    if(p->dev == dev && p->inum == inum && p->pgno == pgno)
+      return p;
+  }
+  return 0;
+}
+
+// drop the least recently used pages above NPCACHE.
+// pages still mapped somewhere stay, so that every shared
+// mapping of a file page sees the same physical page.
+// must hold pcache.lock
+static void
+pcache_evict(void)
+{
+  struct cpage *p, *prev;
+
+  for(p = pcache.head.prev; p != &pcache.head && pcache.n > NPCACHE; p = prev){
+    prev = p->prev;
+    if(ref_cnt_get(p->pa) > 1)
+      continue;
+    lru_unlink(p);
+    hash_unlink(p);
+    pcache.n--;
+    ref_cnt_dec(p->pa);
+    mem_free(p);
+  }
+}
+
+// return the physical page caching page pgno of ip,
+// with a reference for the caller, or 0.
+// bytes beyond the end of the file read as zero.
+// caller must hold ip->lock.
+uint64_t
+pcache_get(inode_t *ip, uint_t pgno)
+{
+  struct cpage *p;
+  uint64_t pa;
+
+  lm_lock(&pcache.lock);
+  if((p = pcache_lookup(ip->dev, ip->inum, pgno)) != 0){
+    lru_unlink(p);
+    lru_push(p);
+    pa = p->pa;
+    ref_cnt_inc(pa);
+    lm_unlock(&pcache.lock);
+    return pa;
+  }
+  lm_unlock(&pcache.lock);
+
+  // not cached, read it without the lock.
+  // ip->lock keeps others from filling the same page.
+  pa = (uint64_t)mem_malloc(PGSIZE);
+  if(pa == 0)
+    return 0;
+  memset((void*)pa, 0, PGSIZE);
+  uint_t off = pgno * PGSIZE;
+  if(off < ip->size){
+    uint_t n = ip->size - off < PGSIZE ? ip->size - off : PGSIZE;
+    if(readi(ip, 0, pa, off, n) != n){
+      mem_free((void*)pa);
+      return 0;
+    }
+  }
+  if((p = mem_malloc(sizeof(*p))) == 0){
+    mem_free((void*)pa);
+    return 0;
+  }
+  p->dev = ip->dev;
+  p->inum = ip->inum;
+  p->pgno = pgno;
+  p->pa = pa;
+  ref_cnt_inc(pa); // the cache's
+  ref_cnt_inc(pa); // the caller's
+
+  lm_lock(&pcache.lock);
+  uint_t h = pchash(p->dev, p->inum, p->pgno);
+  p->hnext = pcache.bucket[h];
+  pcache.bucket[h] = p;
+  lru_push(p);
+  pcache.n++;
+  pcache_evict();
+  lm_unlock(&pcache.lock);
+  return pa;
+}
+
+// forget every cached page of ip, e.g. when its contents change.
+// pages still mapped keep their old contents.
+void
+pcache_invalidate(inode_t *ip)
+{
+  struct cpage *p, *next;
+
+  lm_lock(&pcache.lock);
+  for(p = pcache.head.next; p != &pcache.head; p = next){
+    next = p->next;
+    if(p->dev != ip->dev || p->inum != ip->inum)
+      continue;
+    lru_unlink(p);
+    hash_unlink(p);
+    pcache.n--;
+    ref_cnt_dec(p->pa);
+    mem_free(p);
+  }
+  lm_unlock(&pcache.lock);
+}
+
+// copy n bytes written to ip at off into its cached page, if any.
+// the bytes must not cross a page. src is a buffer cache block,
+// never the cached page itself.
+void
+pcache_write(inode_t *ip, uint_t off, void *src, uint_t n)
+{
+  struct cpage *p;
+
+  lm_lock(&pcache.lock);
+  if((p = pcache_lookup(ip->dev, ip->inum, off / PGSIZE)) != 0)
+    memmove((char*)p->pa + off % PGSIZE, src, n);
+  lm_unlock(&pcache.lock);
+}
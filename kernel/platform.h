@@ -54,6 +54,8 @@ w_mepc(uint64_t x)
 #define SSTATUS_UPIE (1L << 4) // User Previous Interrupt Enable
 #define SSTATUS_SIE (1L << 1)  // Supervisor Interrupt Enable
 #define SSTATUS_UIE (1L << 0)  // User Interrupt Enable
+#define SSTATUS_VS_MASK (3L << 9)    // vector unit state, 0 is off
+#define SSTATUS_VS_INITIAL (1L << 9) // vector unit on, registers clean
 
 
 static inline uint64_t
@@ -275,6 +277,33 @@ r_mcounteren()
   return x;
 }
 
+// Supervisor-mode Counter-Enable
+static inline void 
+w_scounteren(uint64_t x)
+{
+  asm volatile("csrw scounteren, %0" : : "r" (x));
+}
+
+// Machine ISA, a bit for every extension letter
+#define MISA_V (1L << ('V' - 'A'))
+
+static inline uint64_t
+r_misa()
+{
+  uint64_t x;
+  asm volatile("csrr %0, misa" : "=r" (x) );
+  return x;
+}
+
+// cycles executed by this hart
+static inline uint64_t
+r_cycle()
+{
+  uint64_t x;
+  asm volatile("csrr %0, cycle" : "=r" (x) );
+  return x;
+}
+
 // machine-mode cycle counter
 static inline uint64_t
 r_time()
@@ -362,6 +391,7 @@ typedef uint64_t *pagetable_t; // 512 PTEs
 #define PTE_W (1L << 2)
 #define PTE_X (1L << 3)
 #define PTE_U (1L << 4) // user can access
+#define PTE_D (1L << 7) // dirty, set by the hardware on a write
 
 // shift a physical address to the right place for a PTE.
 #define PA2PTE(pa) ((((uint64_t)pa) >> 12) << 10)
@@ -375,6 +405,9 @@ typedef uint64_t *pagetable_t; // 512 PTEs
 #define PXSHIFT(level)  (PGSHIFT+(9*(level)))
 #define PX(level, va) ((((uint64_t) (va)) >> PXSHIFT(level)) & PXMASK)
 
+// bytes mapped by one level-0 page table
+#define LEAFSIZE (1L << PXSHIFT(1))
+
 // one beyond the highest possible virtual address.
 // MAXVA is actually one bit less than the max allowed by
 // Sv39, to avoid having to sign-extend virtual addresses
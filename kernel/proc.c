@@ -18,6 +18,26 @@ task_t tasks[NTASK];
 // lock orde: p->lock -> wait_lock
 lm_lock_t wait_lock;
 
+// sleeping tasks are hashed by chan,
+// so wakeup only looks at the tasks in one bucket
+#define NWAITQ 64
+struct waitq{
+  lm_lock_t lock;
+  task_t *head;
+};
+static struct waitq waitq[NWAITQ];
+
+// cost of wakeup(), printed by waitq_dump()
+static struct{
+  uint64_t calls;   // number of wakeup() calls
+  uint64_t scanned; // sleeping tasks looked at
+  uint64_t woken;   // tasks made RUNNABLE
+}wakeup_stat;
+
+static struct waitq *chan_waitq(void *chan){
+  return &waitq[((uint64_t)chan >> 3) % NWAITQ];
+}
+
 
 inline int cpuid(){
   return r_tp();
@@ -36,6 +56,57 @@ task_t *mytask(void)
   return t;
 }
 
+// push t to the tail of the run queue of t->cpu
+static void runq_push(task_t *t){
+  runq_t *rq = &cpus[t->cpu].rq;
+  lm_lock(&rq->lock);
+  t->rq_next = 0;
+  if(rq->tail)
+    rq->tail->rq_next = t;
+  else
+    rq->head = t;
+  rq->tail = t;
+  rq->len++;
+  lm_unlock(&rq->lock);
+}
+
+// pop the head of rq, return 0 if it is empty
+static task_t *runq_pop(runq_t *rq){
+  lm_lock(&rq->lock);
+  task_t *t = rq->head;
+  if(t){
+    rq->head = t->rq_next;
+    if(rq->head == 0)
+      rq->tail = 0;
+    t->rq_next = 0;
+    rq->len--;
+  }
+  lm_unlock(&rq->lock);
+  return t;
+}
+
+// called by an idle cpu, take one task from the busiest peer
+// len is read without the lock, it is only a hint
+static task_t *runq_steal(cpu_t *c){
+  cpu_t *busiest = 0;
+  for(cpu_t *p = cpus; p < &cpus[NCPU]; p++){
+    if(p == c || p->rq.len == 0)
+      continue;
+    if(busiest == 0 || p->rq.len > busiest->rq.len)
+      busiest = p;
+  }
+  if(busiest == 0)
+    return 0;
+  return runq_pop(&busiest->rq);
+}
+
+// set t RUNNABLE and put it on a run queue
+// must hold t->lock
+void make_runnable(task_t *t){
+  t->state = RUNNABLE;
+  runq_push(t);
+}
+
 static void init_context(task_t *t, void (*entry)(void)){
   context_t *c = &t->context;
   memset(c, 0, sizeof(*c));
@@ -83,7 +154,7 @@ void user_init(){
 
   t->trapframe->sp = high + PGSIZE;// top of the stack
 
-  t->state = RUNNABLE; 
+  make_runnable(t);
   
   t->cwd = namei("/");
 
@@ -146,6 +217,7 @@ task_t * utask_create(){
     if(t->state == DEAD){
       t->id = alloc_pid();
       t->state = USED;
+      t->cpu = cpuid();
 
       init_context(t, ret_entry);
       break;
@@ -187,22 +259,26 @@ void scheduler(void)
     intr_on();
     // printf("scheduler\n");
 
-    for(t = tasks; t < &tasks[NTASK]; t++) {
-      lm_lock(&t->lock);
-      if( t->id !=-1 && t->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        t->state = RUNNING;
-        c->current = t;
-        swtch(&c->context, &t->context);
-
-        // Process is done running for now.
-        // It should have changed its t->state before coming back.
-        c->current = 0;
-      }
-      lm_unlock(&t->lock);
+    // only RUNNABLE tasks are on the run queues,
+    // so an idle cpu doesn't touch the task table at all
+    if((t = runq_pop(&c->rq)) == 0 && (t = runq_steal(c)) == 0)
+      continue;
+
+    lm_lock(&t->lock);
+    if(t->state == RUNNABLE) {
+      // Switch to chosen process.  It is the process's job
+      // to release its lock and then reacquire it
+      // before jumping back to us.
+      t->state = RUNNING;
+      t->cpu = c - cpus;
+      c->current = t;
+      swtch(&c->context, &t->context);
+
+      // Process is done running for now.
+      // It should have changed its t->state before coming back.
+      c->current = 0;
     }
+    lm_unlock(&t->lock);
   }
 }
 
@@ -217,6 +293,13 @@ void task_init(){
   for(int i=0;i<NCPU;i++){
     cpus[i].intena = 0;
     cpus[i].noff = 0;
+    lm_lockinit(&cpus[i].rq.lock, "runq");
+    cpus[i].rq.head = cpus[i].rq.tail = 0;
+    cpus[i].rq.len = 0;
+  }
+  for(int i=0;i<NWAITQ;i++){
+    lm_lockinit(&waitq[i].lock, "waitq");
+    waitq[i].head = 0;
   }
 }
 
@@ -240,8 +323,9 @@ task_t* task_create(void (*entry)(void*), void *arg){
       t->id = t - tasks;
       t->entry = entry;
       t->arg = arg;
-      t->state = RUNNABLE;
+      t->cpu = cpuid();
       init_context(t, real_entry);
+      make_runnable(t);
       lm_unlock(&t->lock);
       return t;
     }
@@ -280,13 +364,16 @@ sched(void)
 void yield(){
   task_t *t = mycpu()->current;
   lm_lock(&t->lock);
-  t->state = RUNNABLE;
+  make_runnable(t);
   sched();
   lm_unlock(&t->lock);
 }
 
+// free the memory of a zombie task.
+// called by sys_wait with p->lock and wait_lock held, so it must
+// not sleep: the files, cwd and mappings are already gone, exit()
+// released them.
 void free_task(task_t *t){
-  // free the memory of pagetable and trapframe
   if(t->pagetable)
     free_pagetable(t->pagetable, 0);
   t->pagetable = 0;
@@ -297,23 +384,6 @@ void free_task(task_t *t){
   t->id = -1;
   t->state = DEAD;
   t->parent = 0;
-  // all allocated memory should be freed in mmap_destroy
-  if(t->mmap_obj)
-    mmap_destroy(t->mmap_obj);
-  t->mmap_obj = 0;
-
-  
-
-    // close file
-  for(int i=0;i<NOFILE;i++){
-    if(t->ofile[i]){
-      fileclose(t->ofile[i]);
-      t->ofile[i] = 0;
-    }
-  }
-  if(t->cwd)
-    iput(t->cwd);
-  t->cwd = 0;
 }
 
 // should be called with the lock of waitlock
@@ -333,6 +403,27 @@ void reparent(task_t *t){
 
 void exit(int status){
   task_t *t = mycpu()->current;
+
+  // closing files, dropping cwd and unmapping may sleep on the
+  // log, the disk or an inode, so do it before taking any lock.
+  // the mappings are destroyed while the pagetable still lists
+  // their pages, free_task frees the pagetable itself.
+  for(int i=0;i<NOFILE;i++){
+    if(t->ofile[i]){
+      fileclose(t->ofile[i]);
+      t->ofile[i] = 0;
+    }
+  }
+  if(t->cwd){
+    begin_op();
+    iput(t->cwd);
+    end_op();
+  }
+  t->cwd = 0;
+  if(t->mmap_obj)
+    mmap_destroy(t->mmap_obj, t->pagetable);
+  t->mmap_obj = 0;
+
   lm_lock(&t->lock);
   t->state = ZOMBIE;
   t->xstatus = status;
@@ -405,20 +496,26 @@ void
 sleep(void *chan, lm_lock_t *lk)
 {
   task_t* t = mytask();
+  struct waitq *wq = chan_waitq(chan);
   
   // Must acquire p->lock in order to
   // change p->state and then call sched.
-  // Once we hold p->lock, we can be
-  // guaranteed that we won't miss any wakeup
-  // (wakeup locks p->lock),
+  // Once we are in the wait queue and hold p->lock,
+  // we can be guaranteed that we won't miss any wakeup
+  // (wakeup locks the wait queue and then p->lock),
   // so it's okay to release lk.
+  // lock order: lk -> wq->lock -> p->lock
 
+  lm_lock(&wq->lock);
   lm_lock(&t->lock);  //DOC: sleeplock1
   lm_unlock(lk);
 
   // Go to sleep.
   t->chan = chan;
   t->state = SLEEPING;
+  t->wq_next = wq->head;
+  wq->head = t;
+  lm_unlock(&wq->lock);
 
   sched();
 
@@ -435,17 +532,31 @@ sleep(void *chan, lm_lock_t *lk)
 void
 wakeup(void *chan)
 {
-  task_t *t;
-  task_t *myt = mytask();
-  for(t = tasks; t < &tasks[NTASK]; t++) {
-    if(t != myt){
-      lm_lock(&t->lock);
-      if(t->state == SLEEPING && t->chan == chan) {
-        t->state = RUNNABLE;
-      }
-      lm_unlock(&t->lock);
+  struct waitq *wq = chan_waitq(chan);
+  task_t **pp, *t;
+
+  __sync_fetch_and_add(&wakeup_stat.calls, 1);
+  lm_lock(&wq->lock);
+  for(pp = &wq->head; (t = *pp) != 0; ){
+    __sync_fetch_and_add(&wakeup_stat.scanned, 1);
+    if(t->chan != chan){
+      // another chan hashed to the same bucket
+      pp = &t->wq_next;
+      continue;
     }
+    *pp = t->wq_next;
+    t->wq_next = 0;
+    lm_lock(&t->lock);
+    make_runnable(t);
+    lm_unlock(&t->lock);
+    __sync_fetch_and_add(&wakeup_stat.woken, 1);
   }
+  lm_unlock(&wq->lock);
+}
+
+void waitq_dump(){
+  printf("wakeup: calls %d scanned %d woken %d\n",
+    (int)wakeup_stat.calls, (int)wakeup_stat.scanned, (int)wakeup_stat.woken);
 }
 
 int sys_exit(){
@@ -476,9 +587,6 @@ int sys_fork(){
   // set the return value of the parent to the pid of the child
   t->trapframe->a0 = nt->id;
 
-  // set the state of the child to RUNNABLE
-  nt->state = RUNNABLE;
-
   // set the parent
   nt->parent = t;
 
@@ -495,6 +603,10 @@ int sys_fork(){
     }
   }
 
+  // set the state of the child to RUNNABLE
+  // only now that it is fully set up, another cpu may pick it
+  make_runnable(nt);
+
   // release the lock of the child
   lm_unlock(&nt->lock);
   return 0;
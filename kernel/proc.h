@@ -82,6 +82,7 @@ typedef struct task
 
 
     void *chan; // If non-zero, sleeping on chan
+    task_t *wq_next; // next task in the wait queue of chan
 
     task_t *parent; // Parent task
     semophore_t sons_sem; // semaphore for sons
@@ -92,8 +93,18 @@ typedef struct task
 
     struct inode *cwd; // Current directory
 
+    int cpu; // cpu whose run queue this task goes to
+    task_t *rq_next; // next task in the run queue
+
 }task_t;
 
+// RUNNABLE tasks waiting for a cpu, FIFO
+typedef struct runq{
+    lm_lock_t lock;
+    task_t *head; // pop from head
+    task_t *tail; // push to tail
+    int len;
+}runq_t;
 
 typedef struct cpu{
 
@@ -102,6 +113,7 @@ typedef struct cpu{
     int noff;
     int intena;
 
+    runq_t rq; // per-cpu run queue
 
 }cpu_t;
 
@@ -33,16 +33,12 @@ typedef struct MmapNode {
     uint64_t perm;
     uint64_t flag;
 
+    struct inode *ip;   // MAP_FILE: the file, holds a reference
+    uint64_t off;       // MAP_FILE: file offset of addr, page aligned
+    uint64_t filesz;    // MAP_FILE: bytes backed by the file, the rest is zero
 
 } MmapNode_t; // mmap entry
 
-typedef struct RefCntNode {
-
-    uint64_t addr;
-    uint64_t ref_cnt;
-
-} RefCntNode_t; // reference count entry
-
 struct rb_tree;
 
 
@@ -74,8 +70,7 @@ struct rb_node
     // user's data
     void *          data;
     enum {
-        MmapNode,
-        RefCntNode
+        MmapNode
     } type;
 };
 
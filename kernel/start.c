@@ -74,6 +74,18 @@ void start(){
 
     timer_init();
 
+    // let supervisor and user mode read the time CSR,
+    // user programs use it to time themselves.
+    // supervisor mode may read cycle too, see membench.
+    w_mcounteren(r_mcounteren() | 3);
+    w_scounteren(2);
+
+    // klib uses the vector unit for large copies when built
+    // with RVV=1 and the hart has one. it stays off otherwise,
+    // see vector_on in klib.c
+    if(r_misa() & MISA_V)
+        has_rvv = 1;
+
     uint64_t id= r_mhartid();
     // cpu id写到tp寄存器，cpuid()函数会用到
     w_tp(id);
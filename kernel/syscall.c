@@ -30,6 +30,9 @@ static int (*syscalls[])(void)={
     [SYS_chdir] = sys_chdir,
     [SYS_ioctl] = sys_ioctl,
     [SYS_close] = sys_close,
+    [SYS_fsync] = sys_fsync,
+    [SYS_diskstat] = sys_diskstat,
+    [SYS_unlink] = sys_unlink,
 };
 
 void syscall(){
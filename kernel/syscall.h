@@ -14,8 +14,10 @@
 #define SYS_chdir 13
 #define SYS_ioctl 14
 #define SYS_close 15    
+#define SYS_fsync 16
+#define SYS_diskstat 17
+#define SYS_unlink 18
 // #define SYS_open 1
 // #define SYS_close 1
 // #define SYS_mkdir 1
 // #define SYS_link 1
-// #define SYS_unlink 1
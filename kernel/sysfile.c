@@ -273,6 +273,7 @@ sys_open(void)
     } else {
         f->type = FD_INODE;
         f->off = 0;
+        f->ra = (struct readahead){0, 0, 0};
     }
     f->ip = ip;
     f->readable = !(omode & O_WRONLY);
@@ -311,18 +312,32 @@ int sys_write(){
         t->trapframe->a0= dev->write(dev, 1, (uint64_t)buf, count);
         
     }else if(f->type==FD_INODE){
-        begin_op();
-        ilock(f->ip);
+        // faulting in buf may need an inode lock
+        uvm_prefault(t->pagetable, (uint64_t)buf, count, 0);
         if(f->writable == 0){
-            iunlock(f->ip);
+            t->trapframe->a0 = -1;
             return -1;
         }
-        int n = writei(f->ip, 1, (uint64_t)buf, f->off, count);
-        if(n > 0)
-            f->off += n;
-        iunlock(f->ip);
-        end_op();
-        t->trapframe->a0 = n;
+        // write a few MB per transaction, so the indirect and
+        // bitmap blocks one writei touches fit in MAXOPBLOCKS
+        int max = 8*NINDIRECT*BSIZE;
+        int n = 0;
+        while(n < count){
+            int n1 = count - n < max ? count - n : max;
+            begin_op();
+            ilock(f->ip);
+            int r = writei(f->ip, 1, (uint64_t)buf + n, f->off, n1);
+            if(r > 0){
+                f->off += r;
+                n += r;
+            }
+            iunlock(f->ip);
+            end_op();
+            if(r != n1)
+                break;
+        }
+        // a short write returns what was written, -1 only if nothing
+        t->trapframe->a0 = n > 0 || count == 0 ? n : -1;
 
     }
     return -1;
@@ -350,14 +365,18 @@ int sys_read(){
         t->trapframe->a0= dev->read(dev, 1, (uint64_t)buf, count);
     }else if(f->type == FD_INODE){
 
+        // faulting in buf may need an inode lock
+        uvm_prefault(t->pagetable, (uint64_t)buf, count, 1);
         ilock(f->ip);
         if(f->readable == 0){
             iunlock(f->ip);
             return -1;
         }
         int n = readi(f->ip, 1, (uint64_t)buf, f->off, count);
-        if(n > 0)
+        if(n > 0){
+            ireadahead(f->ip, &f->ra, f->off, n);
             f->off += n;
+        }
         iunlock(f->ip);
         t->trapframe->a0 = n;
 
@@ -389,9 +408,82 @@ int sys_ioctl(){
             t->trapframe->a0 = -1;
             return -1;
         }
-        t->trapframe->a0= dev->ioctl(dev, request, 1, (uint64_t)buf);
+        t->trapframe->a0 = dev->ioctl(dev, 1, request, (uint64_t)buf);
+        return 0;
     }
     t->trapframe->a0 = -1;
     return -1;
 
-}
\ No newline at end of file
+}
+
+// write everything modified so far to the disk.
+// dirty blocks aren't tracked per file, so this
+// flushes the whole buffer cache, fd's blocks included.
+int sys_fsync(){
+    task_t *t = mytask();
+    int fd = t->trapframe->a0;
+    if (fd < 0 || fd >= NOFILE || t->ofile[fd] == 0)
+    {
+        t->trapframe->a0 = -1;
+        return -1;
+    }
+    bflush();
+    t->trapframe->a0 = 0;
+    return 0;
+}
+
+// diskstat(requests, blocks): the disk requests so far and
+// the blocks they moved, for benchmarks.
+int sys_diskstat(){
+    task_t *t = mytask();
+    uint64_t req, blk;
+    disk_stat(&req, &blk);
+    if(copyout(t->pagetable, t->trapframe->a0, (char*)&req, sizeof(req)) < 0 ||
+       copyout(t->pagetable, t->trapframe->a1, (char*)&blk, sizeof(blk)) < 0){
+        t->trapframe->a0 = -1;
+        return -1;
+    }
+    t->trapframe->a0 = 0;
+    return 0;
+}
+
+// remove a name of a file or device. directories can't be
+// unlinked. the inode is freed with its last reference.
+int sys_unlink(){
+    task_t *t = mytask();
+    char path[MAXPATH], name[DIRSIZ];
+    struct inode *dp, *ip;
+    uint_t off;
+
+    t->trapframe->a0 = -1;
+    if(argstr(0, path, MAXPATH) < 0)
+        return -1;
+    begin_op();
+    if((dp = nameiparent(path, name)) == 0){
+        end_op();
+        return -1;
+    }
+    ilock(dp);
+    if(namecmp(name, ".") == 0 || namecmp(name, "..") == 0 ||
+       (ip = dirlookup(dp, name, &off)) == 0){
+        iunlockput(dp);
+        end_op();
+        return -1;
+    }
+    ilock(ip);
+    if(ip->type == T_DIR){
+        iunlockput(ip);
+        iunlockput(dp);
+        end_op();
+        return -1;
+    }
+    dirunlink(dp, name, off);
+    iunlockput(dp);
+    ip->nlink--;
+    iupdate(ip);
+    iunlockput(ip);
+    end_op();
+
+    t->trapframe->a0 = 0;
+    return 0;
+}
@@ -6,6 +6,8 @@
 #include "memlayout.h"
 #include "types.h"
 #include "defs.h"
+#include "lock.h"
+#include "proc.h"
 // the UART control registers are memory-mapped
 // at address UART0. this macro returns the
 // address of one of the registers.
@@ -30,20 +32,33 @@
 #define LSR 5                 // line status register
 #define LSR_RX_READY (1<<0)   // input is waiting to be read from RHR
 #define LSR_TX_IDLE (1<<5)    // THR can accept another character to send
+#define FIFO_SIZE 16          // bytes the transmit FIFO holds
 
 #define ReadReg(reg) (*(Reg(reg)))
 #define WriteReg(reg, v) (*(Reg(reg)) = (v))
 
 // the transmit output buffer.
+// writers append to it and return, uart_intr refills the FIFO
+// from it every time the FIFO runs empty. user writes sleep
+// while it is full, kernel printf can't sleep and drains it by
+// polling instead.
 
-#define UART_TX_BUF_SIZE 32
+#define UART_TX_BUF_SIZE 1024
+lm_lock_t uart_tx_lock;
 char uart_tx_buf[UART_TX_BUF_SIZE];
 uint64_t uart_tx_w; // write next to uart_tx_buf[uart_tx_w % UART_TX_BUF_SIZE]
 uint64_t uart_tx_r; // read next from uart_tx_buf[uart_tx_r % UART_TX_BUF_SIZE]
 
-extern volatile int panicked; // from printf.c
+struct {
+  uint64_t queued;   // bytes through the ring
+  uint64_t blocked;  // times a user write slept on a full ring
+  uint64_t polled;   // times kernel output drained a full ring itself
+  uint64_t dropped;  // bytes of user writes given up, the writer was killed
+} uart_stat;
 
-void uartstart();
+extern volatile int panicked; // from klib.c
+
+static void uartstart();
 
 void
 uart_init(void)
@@ -65,27 +80,110 @@ uart_init(void)
   WriteReg(LCR, LCR_EIGHT_BITS);
 
   // reset and enable FIFOs.
-//   WriteReg(FCR, FCR_FIFO_ENABLE | FCR_FIFO_CLEAR);
+  WriteReg(FCR, FCR_FIFO_ENABLE | FCR_FIFO_CLEAR);
 
   // enable transmit and receive interrupts.
-  // WriteReg(IER, IER_TX_ENABLE | IER_RX_ENABLE);
+  WriteReg(IER, IER_TX_ENABLE | IER_RX_ENABLE);
 
-  // enable receive interrupts.
-  WriteReg(IER, IER_RX_ENABLE);
+  lm_lockinit(&uart_tx_lock, "uart");
+}
 
+// if the UART is idle, and a character is waiting
+// in the transmit buffer, send up to a FIFO full.
+// caller must hold uart_tx_lock.
+// called from both the top- and bottom-half.
+static void
+uartstart()
+{
+  if(uart_tx_w == uart_tx_r){
+    // transmit buffer is empty.
+    ReadReg(ISR);
+    return;
+  }
+  // LSR_TX_IDLE with the FIFO on means the FIFO is empty
+  if((ReadReg(LSR) & LSR_TX_IDLE) == 0){
+    // the UART transmit FIFO is full,
+    // it will interrupt when it's ready for more.
+    return;
+  }
+  for(int i = 0; i < FIFO_SIZE && uart_tx_r != uart_tx_w; i++)
+    WriteReg(THR, uart_tx_buf[uart_tx_r++ % UART_TX_BUF_SIZE]);
+
+  // maybe uart_write() is waiting for space in the buffer.
+  wakeup(&uart_tx_r);
 }
 
-// maybe block
-// modify later so that it won't block
+// add a character to the output buffer and tell the
+// UART to start sending if it isn't already.
+// never sleeps, so printf and input echo can use it
+// from interrupts: on a full buffer it waits for the
+// UART itself.
 void
 uart_putc(char c)
 {
-  push_off();
-  while((ReadReg(LSR) & LSR_TX_IDLE) ==0){
-    ;
+  lm_lock(&uart_tx_lock);
+  if(uart_tx_w == uart_tx_r + UART_TX_BUF_SIZE)
+    uart_stat.polled++;
+  while(uart_tx_w == uart_tx_r + UART_TX_BUF_SIZE || panicked){
+    // interrupts are off here, do the interrupt's job
+    uartstart();
+    if(panicked && uart_tx_w == uart_tx_r)
+      break;
   }
+  if(panicked){
+    // nothing will interrupt anymore, write it out directly
+    while((ReadReg(LSR) & LSR_TX_IDLE) == 0)
+      ;
     WriteReg(THR, c);
-  pop_off();
+    lm_unlock(&uart_tx_lock);
+    return;
+  }
+  uart_tx_buf[uart_tx_w++ % UART_TX_BUF_SIZE] = c;
+  uart_stat.queued++;
+  uartstart();
+  lm_unlock(&uart_tx_lock);
+}
+
+// add n bytes of user output to the buffer,
+// sleeping while it is full. return how many were added,
+// fewer if the task was killed meanwhile.
+int
+uart_write(const char *s, int n)
+{
+  int i;
+
+  lm_lock(&uart_tx_lock);
+  for(i = 0; i < n; i++){
+    if(uart_tx_w == uart_tx_r + UART_TX_BUF_SIZE){
+      uart_stat.blocked++;
+      // buffer is full.
+      // wait for uartstart() to open up space in the buffer.
+      while(uart_tx_w == uart_tx_r + UART_TX_BUF_SIZE){
+        if(mytask()->killed){
+          uart_stat.queued += i;
+          uart_stat.dropped += n - i;
+          uartstart();
+          lm_unlock(&uart_tx_lock);
+          return i;
+        }
+        uartstart();
+        sleep(&uart_tx_r, &uart_tx_lock);
+      }
+    }
+    uart_tx_buf[uart_tx_w++ % UART_TX_BUF_SIZE] = s[i];
+  }
+  uart_stat.queued += n;
+  uartstart();
+  lm_unlock(&uart_tx_lock);
+  return n;
+}
+
+void
+uart_dump(void)
+{
+  printf("uart: %d bytes queued, %d blocked writes, %d polled, %d bytes dropped\n",
+         (int)uart_stat.queued, (int)uart_stat.blocked,
+         (int)uart_stat.polled, (int)uart_stat.dropped);
 }
 
 // read one input character from the UART.
@@ -101,6 +199,9 @@ uart_getc(void)
   }
 }
 
+// handle a uart interrupt, raised because input has
+// arrived, or the uart is ready for more output, or
+// both. called from devintr().
 void uart_intr()
 {
   int c;
@@ -109,4 +210,9 @@ void uart_intr()
     console_intr(c);
     
   }
+
+  // send buffered characters.
+  lm_lock(&uart_tx_lock);
+  uartstart();
+  lm_unlock(&uart_tx_lock);
 }
@@ -14,6 +14,7 @@
 #include "fs.h"
 #include "buf.h"
 #include "virtio.h"
+#include "param.h"
 
 // the address of virtio mmio register r.
 #define R(r) ((volatile uint32_t *)(VIRTIO0 + (r)))
@@ -55,6 +56,15 @@ static struct disk {
   
   lm_lock_t vdisk_lock;
 
+  struct {
+    uint64_t requests;  // submitted
+    uint64_t blocks;
+    uint64_t depthsum;  // sum of the depth seen by every request
+    uint64_t full;      // times a submit waited for descriptors
+    int inflight;
+    int maxdepth;
+  } stat;
+
   struct virtio_gpu_rect rect;
 
   
@@ -203,12 +213,11 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
 static int
-alloc3_desc(int *idx)
+allocn_desc(int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
+  for(int i = 0; i < n; i++){
     idx[i] = alloc_desc();
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
@@ -219,27 +228,39 @@ alloc3_desc(int *idx)
   return 0;
 }
 
+// read or write n buffers of consecutive blocks,
+// bs[i]->blockno == bs[0]->blockno + i, as one request.
+// returns once the request is queued, without waiting for it:
+// b->disk stays 1 until the device is done with b, then b->end_io
+// is called, if set, from the interrupt with the disk lock held,
+// so it must not sleep. virtio_disk_wait() waits for a buf.
 void
-virtio_disk_rw(struct buf *b, int write)
+virtio_disk_submit(struct buf **bs, int n, int write)
 {
+  struct buf *b = bs[0];
   uint64_t sector = b->blockno * (BSIZE / 512);
 
+  if(n < 1 || n > MAXBRUN)
+    panic("virtio_disk_submit");
+
   lm_lock(&disk.vdisk_lock);
 
   // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
+  // a descriptor for type/reserved/sector, then the data, then
+  // one for a 1-byte status result. the data may be split over
+  // several descriptors, we use one per buffer.
 
-  // allocate the three descriptors.
-  int idx[3];
+  // allocate the descriptors.
+  int idx[MAXBRUN + 2];
   while(1){
-    if(alloc3_desc(idx) == 0) {
+    if(allocn_desc(idx, n + 2) == 0) {
       break;
     }
+    disk.stat.full++;
     sleep(&disk.free[0], &disk.vdisk_lock);
   }
 
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
   struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
@@ -256,25 +277,40 @@ virtio_disk_rw(struct buf *b, int write)
   disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
   disk.desc[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64_t) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  for(int i = 0; i < n; i++){
+    int d = idx[i + 1];
+    if(bs[i]->blockno != b->blockno + i)
+      panic("virtio_disk_submit: not contiguous");
+    disk.desc[d].addr = (uint64_t) bs[i]->data;
+    disk.desc[d].len = BSIZE;
+    if(write)
+      disk.desc[d].flags = 0; // device reads b->data
+    else
+      disk.desc[d].flags = VRING_DESC_F_WRITE; // device writes b->data
+    disk.desc[d].flags |= VRING_DESC_F_NEXT;
+    disk.desc[d].next = idx[i + 2];
+
+    // record the bufs for virtio_disk_intr().
+    bs[i]->disk = 1;
+    bs[i]->io_next = i + 1 < n ? bs[i + 1] : 0;
+  }
 
+  int st = idx[n + 1];
   disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64_t) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+  disk.desc[st].addr = (uint64_t) &disk.info[idx[0]].status;
+  disk.desc[st].len = 1;
+  disk.desc[st].flags = VRING_DESC_F_WRITE; // device writes the status
+  disk.desc[st].next = 0;
 
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
   disk.info[idx[0]].b = b;
 
+  disk.stat.requests++;
+  disk.stat.blocks += n;
+  disk.stat.inflight++;
+  disk.stat.depthsum += disk.stat.inflight;
+  if(disk.stat.inflight > disk.stat.maxdepth)
+    disk.stat.maxdepth = disk.stat.inflight;
+
   // tell the device the first index in our chain of descriptors.
   disk.avail->ring[disk.avail->idx % NUM] = idx[0];
 
@@ -287,14 +323,54 @@ virtio_disk_rw(struct buf *b, int write)
 
   *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
 
-  // Wait for virtio_disk_intr() to say request has finished.
+  lm_unlock(&disk.vdisk_lock);
+}
+
+// wait until the device is done with b.
+void
+virtio_disk_wait(struct buf *b)
+{
+  lm_lock(&disk.vdisk_lock);
   while(b->disk == 1) {
     sleep(b, &disk.vdisk_lock);
   }
+  lm_unlock(&disk.vdisk_lock);
+}
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  virtio_disk_rwv(&b, 1, write);
+}
+
+// like virtio_disk_submit, but wait for the request to finish.
+void
+virtio_disk_rwv(struct buf **bs, int n, int write)
+{
+  virtio_disk_submit(bs, n, write);
+  for(int i = 0; i < n; i++)
+    virtio_disk_wait(bs[i]);
+}
+
+// requests so far and the blocks they moved, for diskstat()
+void
+disk_stat(uint64_t *requests, uint64_t *blocks)
+{
+  lm_lock(&disk.vdisk_lock);
+  *requests = disk.stat.requests;
+  *blocks = disk.stat.blocks;
+  lm_unlock(&disk.vdisk_lock);
+}
 
+// queue depth statistics, for ^T
+void
+disk_dump(void)
+{
+  lm_lock(&disk.vdisk_lock);
+  uint64_t avg10 = disk.stat.requests ? disk.stat.depthsum * 10 / disk.stat.requests : 0;
+  printf("disk: %d requests %d blocks, in flight %d, max depth %d, avg depth %d.%d, ring full %d\n",
+         (int)disk.stat.requests, (int)disk.stat.blocks, disk.stat.inflight, disk.stat.maxdepth,
+         (int)(avg10 / 10), (int)(avg10 % 10), (int)disk.stat.full);
   lm_unlock(&disk.vdisk_lock);
 }
 
@@ -324,8 +400,19 @@ virtio_disk_intr()
       panic("virtio_disk_intr status");
 
     struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
+    disk.info[id].b = 0;
+    free_chain(id);
+    disk.stat.inflight--;
+
+    while(b){
+      struct buf *next = b->io_next;
+      b->io_next = 0;
+      b->disk = 0;   // disk is done with buf
+      wakeup(b);
+      if(b->end_io)
+        b->end_io(b);
+      b = next;
+    }
 
     disk.used_idx += 1;
   }
@@ -318,8 +318,6 @@ void virtio_gpu_resource_flush(){
 
   panic_on(resp.type != VIRTIO_GPU_RESP_OK_NODATA, "virtio_gpu_resource_flush failed");
 
-  printf("virtio_gpu_resource_flush success\n");
-
 }
 
 
@@ -386,8 +384,6 @@ void virtio_gpu_transfer_to_host_2d(){
 
   panic_on(resp.type != VIRTIO_GPU_RESP_OK_NODATA, "virtio_gpu_transfer_to_host_2d failed");
 
-  printf("virtio_gpu_transfer_to_host_2d success\n");
-
 }
 
 
@@ -3,6 +3,8 @@
 #include "types.h"
 #include "defs.h"
 #include "error.h"  
+#include "proc.h"
+#include "mmap.h"
 
 // virtual memory module 
 // Sv39
@@ -164,6 +166,15 @@ pte_t* walk(pagetable_t pagetable, uint64_t va, int alloc){
 
 }
 
+// return the level-0 page table covering va,
+// it holds the PTEs of the 2MB aligned region around va
+pagetable_t walk_leaf(pagetable_t pagetable, uint64_t va, int alloc){
+    pte_t *pte = walk(pagetable, va, alloc);
+    if(pte == 0)
+        return 0;
+    return (pagetable_t)PGROUNDDOWN((uint64_t)pte);
+}
+
 int is_pagetable(pte_t pte){
     return (pte & PTE_V) && (pte & (PTE_R|PTE_W|PTE_X)) == 0;
 }
@@ -240,6 +251,72 @@ void copy_pagetable(pagetable_t from , pagetable_t to, int cover){
   }
 }
 
+// like walkaddr, but a page that isn't mapped yet, or is
+// copy-on-write and about to be written, is faulted in
+// through the mappings of the current task.
+static uint64_t
+uvm_addr(pagetable_t pagetable, uint64_t va, int write)
+{
+  pte_t *pte;
+  task_t *t;
+
+  if(va >= MAXVA)
+    return 0;
+  pte = walk(pagetable, va, 0);
+  if(pte && (*pte & PTE_V) && (*pte & PTE_U) && (!write || (*pte & PTE_W)))
+    return PTE2PA(*pte) | (va & 0xFFF);
+
+  t = mytask();
+  if(t == 0 || t->pagetable != pagetable || t->mmap_obj == 0)
+    return 0;
+  if(mmap_fault(t, va, write ? PERM_W : PERM_R) < 0)
+    return 0;
+  return walkaddr(pagetable, va);
+}
+
+// a walk over consecutive user pages. the level-0 table of the
+// LEAFSIZE region being copied is kept, so every page after the
+// first one in it costs one PTE load instead of a page table walk.
+struct uwalk {
+  pagetable_t pagetable;
+  pagetable_t leaf; // level-0 table covering base, or 0
+  uint64_t base;    // LEAFSIZE aligned
+};
+
+static uint64_t
+uwalk_addr(struct uwalk *w, uint64_t va, int write)
+{
+  if(va >= MAXVA)
+    return 0;
+  if(w->leaf == 0 || (va & ~(LEAFSIZE - 1)) != w->base){
+    w->leaf = walk_leaf(w->pagetable, va, 0);
+    w->base = va & ~(LEAFSIZE - 1);
+  }
+  if(w->leaf){
+    pte_t pte = w->leaf[PX(0, va)];
+    if((pte & PTE_V) && (pte & PTE_U) && (!write || (pte & PTE_W)))
+      return PTE2PA(pte) | (va & 0xFFF);
+  }
+  // not mapped or copy-on-write, the fault path may change
+  // the page table
+  w->leaf = 0;
+  return uvm_addr(w->pagetable, va, write);
+}
+
+// fault in the user pages of [va, va+len) ahead of time,
+// so that copyin/copyout won't need to while the caller
+// holds locks the fault path takes, like an inode lock.
+void
+uvm_prefault(pagetable_t pagetable, uint64_t va, uint64_t len, int write)
+{
+  if(len == 0)
+    return;
+  for(uint64_t a = PGROUNDDOWN(va); a < va + len; a += PGSIZE){
+    if(uvm_addr(pagetable, a, write) == 0)
+      break;
+  }
+}
+
 // Copy from kernel to user.
 // Copy len bytes from src to virtual address dstva in a given page table.
 // Return 0 on success, -1 on error.
@@ -247,10 +324,11 @@ int
 copyout(pagetable_t pagetable, uint64_t dstva, char *src, uint64_t len)
 {
   uint64_t n, va0, pa0;
+  struct uwalk w = {pagetable};
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uwalk_addr(&w, va0, 1);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (dstva - va0);
@@ -272,10 +350,11 @@ int
 copyin(pagetable_t pagetable, char *dst, uint64_t srcva, uint64_t len)
 {
   uint64_t n, va0, pa0;
+  struct uwalk w = {pagetable};
 
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uwalk_addr(&w, va0, 0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
@@ -290,35 +369,38 @@ copyin(pagetable_t pagetable, char *dst, uint64_t srcva, uint64_t len)
   return 0;
 }
 
+// Copy a null-terminated string from user to kernel, at most
+// max_len bytes with the null. Return its length, or -1.
+// the string is scanned a page at a time through the page's
+// kernel address.
 int copyinstr(pagetable_t pagetable, char *dst, uint64_t srcva, uint64_t max_len){
 
   uint64_t n, va0, pa0;
-  int len = 0;
+  uint64_t len = 0;
+  struct uwalk w = {pagetable};
+
   while(len < max_len){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uwalk_addr(&w, va0, 0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
     if(n > max_len - len)
       n = max_len - len;
-    for(int i=0;i<n;i++){
-      char c;
-      memmove(&c, (void *)(pa0 + (srcva - va0)), 1);
-      if(c == 0){
-        dst[len] = 0;
+    char *p = (char *)(pa0 + (srcva - va0));
+    for(char *e = p + n; p < e; p++){
+      if((dst[len] = *p) == 0)
         return len;
-      }
-      dst[len++] = c;
-      srcva++;
+      len++;
     }
+    srcva = va0 + PGSIZE;
   }
   return -1;
 
 }
 
 int fetchaddr(pagetable_t pagetable, uint64_t va, uint64_t *slot){
-  uint64_t pa = walkaddr(pagetable, va);
+  uint64_t pa = uvm_addr(pagetable, va, 0);
   if(pa == 0)
     return -1;
   *slot = *(uint64_t*)pa;
@@ -326,17 +408,5 @@ int fetchaddr(pagetable_t pagetable, uint64_t va, uint64_t *slot){
 }
 
 int fetchstr(pagetable_t pagetable, uint64_t srcva, char *dst, int max){
-  int len = 0;
-  while(len < max){
-    char c;
-    if(copyin(pagetable, &c, srcva, 1) < 0)
-      return -1;
-    if(c == 0){
-      dst[len] = 0;
-      return len;
-    }
-    dst[len++] = c;
-    srcva++;
-  }
-  return -1;
+  return copyinstr(pagetable, dst, srcva, max);
 }
\ No newline at end of file
@@ -29,8 +29,10 @@ uint8_t *addr;
 map<uint_t, buf> bufmap; // cache
 dinode *root_dip=nullptr;
 
+#define NLOG (LOGSIZE+1) // header block and logged blocks
+
 // Disk layout:
-// [ boot block | super block | inode blocks |
+// [ boot block | super block | log | inode blocks |
 //                                          free bit map | data blocks]
 //
 // mkfs computes the super block and builds an initial file system. The
@@ -40,8 +42,10 @@ struct superblock sb={
     .size = 256*1024*1024, // 256MB
     .nblocks = 256*1024*1024/BSIZE,
     .ninodes = 1024*BSIZE/sizeof(struct dinode), // 1024 block inodes
-    .inodestart = 2,
-    .bmapstart = 2 + 1024
+    .inodestart = 2 + NLOG,
+    .bmapstart = 2 + NLOG + 1024,
+    .nlog = NLOG,
+    .logstart = 2
 };
 
 
@@ -61,11 +65,10 @@ void brelse(struct buf *b){
     ;
 }
 
+// the bitmap has a bit for every block of the disk
 uint_t get_datastart(){
 
-    uint_t bits = (sb.nblocks)/ (BPB); 
-    uint_t Bs = bits*8;
-    uint_t blocks = (Bs+BSIZE-1)/BSIZE;
+    uint_t blocks = (sb.nblocks + BPB - 1) / BPB;
     return sb.bmapstart + blocks;
 
 }
@@ -291,8 +294,9 @@ int main(int argc, char **argv){
         dip->nlink = 1;    
         dip->size = size;
 
-        int pblock = 0;
+        uint_t pblock = 0;
         struct buf *indirect = 0;
+        struct buf *dindirect = 0;
 
         
         FILE *f = fopen(name.c_str(), "rb");
@@ -311,13 +315,27 @@ int main(int argc, char **argv){
             }
             if(pblock < NDIRECT){
                 dip->addrs[pblock] = bno;
-            }else{
+            }else if(pblock < NDIRECT + NINDIRECT){
                 if(indirect == 0){
                     int indirect_bno = balloc();
                     dip->addrs[NDIRECT] = indirect_bno;
                     indirect = bread(indirect_bno);
                 }
                 ((uint_t*)indirect->data)[pblock-NDIRECT] = bno;
+            }else{
+                // double indirect, a new indirect block every NINDIRECT blocks
+                uint_t dbn = pblock - NDIRECT - NINDIRECT;
+                if(dindirect == 0){
+                    int dindirect_bno = balloc();
+                    dip->addrs[NDIRECT+1] = dindirect_bno;
+                    dindirect = bread(dindirect_bno);
+                }
+                if(dbn % NINDIRECT == 0){
+                    int indirect_bno = balloc();
+                    ((uint_t*)dindirect->data)[dbn / NINDIRECT] = indirect_bno;
+                    indirect = bread(indirect_bno);
+                }
+                ((uint_t*)indirect->data)[dbn % NINDIRECT] = bno;
             }
             pblock++;
             
@@ -326,6 +344,7 @@ int main(int argc, char **argv){
             
         }
         brelse(indirect);
+        brelse(dindirect);
         ent.inum = inum;
 
         name = name.substr(name.find_last_of('_')+1);
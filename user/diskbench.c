@@ -0,0 +1,68 @@
+#include "ulib.h"
+#include "usyscall.h"
+#include "kernel/fctrl.h"
+#include "kernel/fs.h"
+
+// sequential read throughput with small and large read() calls.
+// the file is larger than the buffer cache can grow (1/8 of RAM),
+// so reading it from the start misses the cache all the way.
+
+#define FILESZ (24 * 1024 * 1024)
+#define BIGBUF (64 * 1024)
+
+static char buf[BIGBUF];
+
+// read the whole file in chunk sized calls and report
+// KiB/s and the disk requests it took
+static void readall(char *path, int chunk){
+    int fd = open(path, O_RDONLY);
+    if(fd < 0){
+        fprintf(2, "diskbench: open %s failed\n", path);
+        exit(1);
+    }
+    uint64_t total = 0;
+    uint64_t req0, blk0, req, blk;
+    diskstat(&req0, &blk0);
+    uint64_t t0 = get_time();
+    int n;
+    while((n = read(fd, buf, chunk)) > 0)
+        total += n;
+    uint64_t t = get_time() - t0;
+    diskstat(&req, &blk);
+    req -= req0;
+    blk -= blk0;
+    close(fd);
+    if(total != FILESZ)
+        fprintf(2, "diskbench: read %d bytes\n", (int)total);
+    if(t == 0)
+        t = 1;
+    // the time CSR ticks at 10MHz
+    printf("diskbench: %d KiB reads %d KiB/s, %d disk requests %d blocks, %d blocks/request\n",
+           chunk / 1024, (int)(total * 10000000 / 1024 / t), (int)req, (int)blk,
+           (int)(req ? blk / req : 0));
+}
+
+int main(int argc, char **argv){
+    char *path = "diskbench.tmp";
+    int fd = open(path, O_CREATE | O_RDWR);
+    if(fd < 0){
+        fprintf(2, "diskbench: create %s failed\n", path);
+        exit(1);
+    }
+    for(int i = 0; i < BIGBUF; i++)
+        buf[i] = i;
+    for(int off = 0; off < FILESZ; off += BIGBUF){
+        if(write(fd, buf, BIGBUF) != BIGBUF){
+            fprintf(2, "diskbench: write failed\n");
+            exit(1);
+        }
+    }
+    // dirty buffers stay in the cache until written back
+    fsync(fd);
+    close(fd);
+
+    readall(path, BSIZE);
+    readall(path, BIGBUF);
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,38 @@
+#include "ulib.h"
+#include "usyscall.h"
+#include "kernel/mmap.h"
+#include "kernel/memlayout.h"
+
+// fork latency against the resident size of the parent
+
+#define ROUNDS 8
+
+static int sizes[] = {0, 16, 64, 256, 1024, 4096}; // resident pages
+
+int main(int argc, char **argv){
+
+    for(int i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++){
+        int pages = sizes[i];
+        char *p = 0;
+        if(pages){
+            p = (char*)mmap(0, pages * PGSIZE, PERM_R | PERM_W, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            for(int j = 0; j < pages; j++)
+                p[j * PGSIZE] = j; // make it resident
+        }
+
+        uint64_t total = 0;
+        for(int r = 0; r < ROUNDS; r++){
+            uint64_t t0 = get_time();
+            int pid = fork();
+            if(pid == 0)
+                exit(0);
+            total += get_time() - t0;
+            wait(0);
+        }
+        printf("forkbench: %d resident pages, fork %d time units\n", pages, (int)(total / ROUNDS));
+
+        if(pages)
+            munmap((uint64_t)p, pages * PGSIZE);
+    }
+    return 0;
+}
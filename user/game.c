@@ -199,7 +199,7 @@ void draw_screen(){
     }
     draw_snake();
     draw_food();
-    write(monitor_fd, (char*)buf, info.width*info.height*4);
+    ioctl(monitor_fd, MONITOR_PRESENT, 0);
 }
 
 
@@ -221,13 +221,18 @@ int main(){
     nodes_per_line = info.width/node_size;
     lines_per_screen = info.height/node_size;
 
-    buf = (uint8_t*)malloc(info.width*info.height*4);
+    // draw straight into the framebuffer
+    buf = (uint8_t*)ioctl(monitor_fd, MONITOR_MAP, 0);
+    if(buf == (uint8_t*)-1){
+        fprintf(2, "cannot map monitor\n");
+        exit(1);
+    }
 
     for(int i = 0; i < info.width*info.height*4; i++){
         buf[i] = 255;
     }
 
-    write(monitor_fd, (char*)buf, info.width*info.height*4);
+    ioctl(monitor_fd, MONITOR_PRESENT, 0);
     
     int keyboard_fd = open("/dev/keyboard", O_RDONLY);
     
@@ -261,7 +266,6 @@ int main(){
     }
 
 
+    munmap((uint64_t)buf, info.width*info.height*4);
     close(monitor_fd);
-
-    free(buf);
 }
\ No newline at end of file
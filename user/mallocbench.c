@@ -0,0 +1,54 @@
+#include "ulib.h"
+#include "usyscall.h"
+
+// malloc/free latency for small and large blocks
+
+#define ROUNDS 1000
+#define NLIVE 64
+
+static int sizes[] = {16, 64, 256, 1024, 2000, 8192, 65536};
+
+static void* live[NLIVE];
+
+int main(int argc, char **argv){
+
+    for(int i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++){
+        int sz = sizes[i];
+        int rounds = sz > 4096 ? ROUNDS / 10 : ROUNDS;
+
+        // allocate and free right away, the best case for reuse
+        uint64_t t0 = get_time();
+        for(int r = 0; r < rounds; r++){
+            char *p = malloc(sz);
+            if(p == 0){
+                fprintf(2, "mallocbench: malloc %d failed\n", sz);
+                exit(1);
+            }
+            p[0] = r;
+            free(p);
+        }
+        uint64_t single = (get_time() - t0) / rounds;
+
+        // keep NLIVE blocks alive and replace them round robin
+        t0 = get_time();
+        for(int r = 0; r < rounds; r++){
+            int k = r % NLIVE;
+            if(live[k])
+                free(live[k]);
+            if((live[k] = malloc(sz)) == 0){
+                fprintf(2, "mallocbench: malloc %d failed\n", sz);
+                exit(1);
+            }
+            ((char*)live[k])[sz - 1] = r;
+        }
+        uint64_t churn = (get_time() - t0) / rounds;
+        for(int k = 0; k < NLIVE; k++){
+            free(live[k]);
+            live[k] = 0;
+        }
+
+        printf("mallocbench: %d bytes, malloc+free %d time units, with %d live %d time units\n",
+               sz, (int)single, NLIVE, (int)churn);
+    }
+    return 0;
+}
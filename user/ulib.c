@@ -248,23 +248,105 @@ printf(const char *fmt, ...)
   vprintf(1, fmt, ap);
 }
 
-void* malloc(size_t n){
+// memory allocator
+// small blocks come from free lists, one per power of two size class,
+// carved out of ARENASZ arenas that are mapped once and never returned.
+// larger blocks get a mapping of their own.
+// a block starts with a HDRSZ header whose first word is the size class
+// of a small block or the mapping size of a large one. the header is
+// padded so that, with page aligned arenas and class sizes that are
+// multiples of 16, every block handed out is 16 byte aligned.
+
+#define NCLASS 7                  // 32 .. 2048 bytes
+#define CLASSSZ(c) (32UL << (c))
+#define ARENASZ (64 * 1024)
+#define HDRSZ 16
+
+struct freeblock {
+  size_t hdr;
+  struct freeblock *next;
+};
+
+static struct freeblock *freelist[NCLASS];
+static char *arena;    // the unused part of the current arena
+static char *arena_end;
 
-  size_t total = n + sizeof(size_t);
-  void *ptr = (void*)mmap(0, total, PERM_R| PERM_W, MAP_PRIVATE | MAP_ANONYMOUS);
-  if(ptr == (void*)-1)
-    return NULL;
-  *((size_t*)((uint8_t*)ptr+ total-sizeof(size_t))) = total;
-  return ptr;
+static void
+freelist_push(int c, void *p)
+{
+  struct freeblock *b = p;
+  b->hdr = c;
+  b->next = freelist[c];
+  freelist[c] = b;
+}
 
+// start a new arena, the tail of the old one goes to the free lists
+static int
+arena_grow(void)
+{
+  while(arena_end - arena >= CLASSSZ(0)){
+    int c = NCLASS - 1;
+    while(CLASSSZ(c) > arena_end - arena)
+      c--;
+    freelist_push(c, arena);
+    arena += CLASSSZ(c);
+  }
+  char *p = (char*)mmap(0, ARENASZ, PERM_R | PERM_W, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(p == (char*)-1)
+    return -1;
+  arena = p;
+  arena_end = p + ARENASZ;
+  return 0;
+}
+
+void* malloc(size_t n){
+  size_t total = n + HDRSZ;
+  size_t *p;
+
+  if(total > CLASSSZ(NCLASS - 1)){
+    total = (total + PGSIZE - 1) & ~(size_t)(PGSIZE - 1);
+    p = (size_t*)mmap(0, total, PERM_R | PERM_W, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(p == (size_t*)-1)
+      return NULL;
+    *p = total;
+    return (char*)p + HDRSZ;
+  }
+
+  int c = 0;
+  while(CLASSSZ(c) < total)
+    c++;
+  if(freelist[c]){
+    p = (size_t*)freelist[c];
+    freelist[c] = freelist[c]->next;
+  } else {
+    if(arena_end - arena < CLASSSZ(c) && arena_grow() < 0)
+      return NULL;
+    p = (size_t*)arena;
+    arena += CLASSSZ(c);
+  }
+  *p = c;
+  return (char*)p + HDRSZ;
 }
 
 void free(void *ptr){
-  munmap((uint64_t)ptr, *((size_t*)(ptr-sizeof(size_t))));
+  if(ptr == NULL)
+    return;
+  size_t *p = (size_t*)((char*)ptr - HDRSZ);
+  if(*p < NCLASS)
+    freelist_push(*p, p);
+  else
+    munmap((uint64_t)p, *p);
 }
 
 uint_t get_timer_ticks(){
 
   return *((uint_t*)USERRDONLYMAP);
 
+}
+
+// read the time CSR, 10MHz in qemu
+uint64_t get_time(){
+  uint64_t x;
+  asm volatile("rdtime %0" : "=r" (x) );
+  return x;
 }
\ No newline at end of file
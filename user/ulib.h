@@ -16,4 +16,5 @@ void printf(const char *fmt, ...);
 void _main();
 void* malloc(size_t n);
 void free(void *p);
-uint_t get_timer_ticks();
\ No newline at end of file
+uint_t get_timer_ticks();
+uint64_t get_time();
\ No newline at end of file
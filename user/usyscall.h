@@ -2,7 +2,7 @@
 int exit(int);
 int fork();
 int wait(int*);
-uint64_t mmap(uint64_t addr, uint64_t sz, uint64_t perm, uint64_t flag);
+uint64_t mmap(uint64_t addr, uint64_t sz, uint64_t perm, uint64_t flag, int fd, uint64_t offset);
 int munmap(uint64_t addr, uint64_t sz);
 uint64_t write(int fd, char*, uint64_t);
 uint64_t read(int fd, char*, uint64_t);
@@ -12,4 +12,7 @@ int exec(const char *pathname, char *const argv[]);
 int open(const char*pathname, uint64_t mode);
 int chdir(const char*pathname);
 uint64_t ioctl(int fd, uint64_t cmd, uint64_t arg);
-int close(int fd);
\ No newline at end of file
+int close(int fd);
+int fsync(int fd);
+int diskstat(uint64_t *requests, uint64_t *blocks);
+int unlink(const char *path);
\ No newline at end of file